@@ -18,3 +18,15 @@ V = @
 # following line and set it to the full path to QEMU.
 #
 # QEMU=
+
+# To build JOS with PAE paging (64-bit page table entries, physical
+# memory above 4GB), uncomment the following line or run
+# 'make CONFIG_PAE=1'.  Run 'make clean' after changing it.
+#
+# CONFIG_PAE=1
+
+# To give user pages physical addresses spread evenly over the L2 cache
+# sets (page coloring), uncomment the following line or run
+# 'make CONFIG_PAGE_COLOR=1'.  Run 'make clean' after changing it.
+#
+# CONFIG_PAGE_COLOR=1
@@ -29,6 +29,10 @@ typedef int32_t envid_t;
 #define NENV			(1 << LOG2NENV)
 #define ENVX(envid)		((envid) & (NENV - 1))
 
+// Most pages an environment's page faults may resolve at once
+// (see sys_env_set_fault_around).
+#define FAULT_AROUND_MAX	64
+
 // Values of env_status in struct Env
 enum {
 	ENV_FREE = 0,
@@ -58,6 +62,9 @@ struct Env {
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
+	uint32_t env_fault_around;	// Pages a fault may resolve at once
+	uint32_t env_pgfaults;		// Page faults taken in user mode
+	uint32_t env_pgfaults_around;	// Pages resolved around them
 
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
@@ -16,6 +16,7 @@ enum {
 
 	E_IPC_NOT_RECV	= 7,	// Attempt to send to env that is not recving
 	E_EOF		= 8,	// Unexpected end of file
+	E_IO		= 9,	// Device I/O error
 
 	MAXERROR
 };
@@ -53,6 +53,14 @@ int	sys_page_map(envid_t src_env, void *src_pg,
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_meminfo(envid_t env, struct MemInfo *info);
+int	sys_page_reserve(envid_t env, void *pg, int perm);
+int	sys_page_alloc_range(envid_t env, void *pg, size_t npages, int perm);
+int	sys_page_map_range(envid_t src_env, void *src_pg,
+			   envid_t dst_env, void *dst_pg, size_t npages, int perm);
+int	sys_page_unmap_range(envid_t env, void *pg, size_t npages);
+envid_t	sys_fork(void);
+int	sys_env_set_fault_around(envid_t env, size_t npages);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline))
@@ -74,7 +82,7 @@ envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
 #define	PTE_SHARE	0x400
-envid_t	(*fork)(void);
+envid_t	fork(void);
 envid_t	dumbfork(void);
 envid_t	sfork(void);	// Challenge!
 
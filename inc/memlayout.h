@@ -42,11 +42,13 @@
  *                     |      Invalid Memory (*)      | --/--  KSTKGAP    |
  *                     +------------------------------+                   |
  *                     :              .               :                   |
- *                     :              .               :                   |
- *    MMIOLIM ------>  +------------------------------+ 0xefc00000      --+
+ *                     | - - - - - - - - - - - - - - -|                   |
+ *                     |   Per-CPU kmap Windows (**)  | RW/--             |
+ *    MMIOLIM, ----->  +------------------------------+ 0xefc00000      --+
+ *    KMAPBASE
  *                     |       Memory-mapped I/O      | RW/--  PTSIZE
  * ULIM, MMIOBASE -->  +------------------------------+ 0xef800000
- *                     |  Cur. Page Table (User R-)   | R-/R-  PTSIZE
+ *                     |  Cur. Page Table (User R-)   | R-/R-  UVPTSIZE
  *    UVPT      ---->  +------------------------------+ 0xef400000
  *                     |          RO PAGES            | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
@@ -80,12 +82,19 @@
  * (*) Note: The kernel ensures that "Invalid Memory" is *never* mapped.
  *     "Empty Memory" is normally unmapped, but user programs may map pages
  *     there if desired.  JOS user programs map pages temporarily at UTEMP.
+ *
+ * (**) Note: Physical memory above HIGHMEM is not mapped at KERNBASE.
+ *     The kernel reaches those pages through short-lived mappings in a
+ *     few per-CPU slots starting at KMAPBASE (see kmap in kern/pmap.c).
  */
 
 
 // All physical memory mapped at this address
 #define	KERNBASE	0xF0000000
 
+// Physical memory from here on does not fit above KERNBASE ("high memory")
+#define HIGHMEM		0x10000000
+
 // At IOPHYSMEM (640K) there is a 384K hole for I/O.  From the kernel,
 // IOPHYSMEM can be addressed at KERNBASE + IOPHYSMEM.  The hole ends
 // at physical address EXTPHYSMEM.
@@ -101,6 +110,11 @@
 #define MMIOLIM		(KSTACKTOP - PTSIZE)
 #define MMIOBASE	(MMIOLIM - PTSIZE)
 
+// Per-CPU temporary mappings of high memory, KMAP_NSLOTS pages per CPU,
+// at the bottom of the kernel stacks' page table.
+#define KMAPBASE	MMIOLIM
+#define KMAP_NSLOTS	4
+
 #define ULIM		(MMIOBASE)
 
 /*
@@ -108,8 +122,10 @@
  * They are global pages mapped in at env allocation time.
  */
 
-// User read-only virtual page table (see 'uvpt' below)
-#define UVPT		(ULIM - PTSIZE)
+// User read-only virtual page table (see 'uvpt' below); it is as large as
+// all the page tables of an address space: PTSIZE, or 4 * PTSIZE with PAE.
+#define UVPTSIZE	(NPDENTRIES * PGSIZE)
+#define UVPT		(ULIM - UVPTSIZE)
 // Read-only copies of the Page structures
 #define UPAGES		(UVPT - PTSIZE)
 // Read-only copies of the global env structures
@@ -127,30 +143,41 @@
 // Top of normal user stack
 #define USTACKTOP	(UTOP - 2*PGSIZE)
 
+// The low end of user memory is laid out in 4MB units whatever PTSIZE is,
+// to match user/user.ld.
+#define ULOWSIZE	0x400000
+
 // Where user programs generally begin
-#define UTEXT		(2*PTSIZE)
+#define UTEXT		(2*ULOWSIZE)
 
 // Used for temporary page mappings.  Typed 'void*' for convenience
-#define UTEMP		((void*) PTSIZE)
+#define UTEMP		((void*) ULOWSIZE)
 // Used for temporary page mappings for the user page-fault handler
 // (should not conflict with other temporary page mappings)
-#define PFTEMP		(UTEMP + PTSIZE - PGSIZE)
+#define PFTEMP		(UTEMP + ULOWSIZE - PGSIZE)
 // The location of the user-level STABS data structure
-#define USTABDATA	(PTSIZE / 2)
+#define USTABDATA	(ULOWSIZE / 2)
 
 // Physical address of startup code for non-boot CPUs (APs)
 #define MPENTRY_PADDR	0x7000
 
 #ifndef __ASSEMBLER__
 
+#ifdef JOS_PAE
+typedef uint64_t pte_t;
+typedef uint64_t pde_t;
+#else
 typedef uint32_t pte_t;
 typedef uint32_t pde_t;
+#endif
 
 #if JOS_USER
 /*
  * The page directory entry corresponding to the virtual address range
  * [UVPT, UVPT + PTSIZE) points to the page directory itself.  Thus, the page
  * directory is treated as a page table as well as a page directory.
+ * (With PAE, the four entries covering [UVPT, UVPT + UVPTSIZE) point to
+ * the four pages of the page directory, with the same effect.)
  *
  * One result of treating the page directory as a page table is that all PTEs
  * can be accessed through a "virtual page table" at virtual address UVPT (to
@@ -176,8 +203,35 @@ extern volatile pde_t uvpd[];     // VA of current page directory
  * with page2pa() in kern/pmap.h.
  */
 struct PageInfo {
-	// Next page on the free list.
-	struct PageInfo *pp_link;
+	union {
+		// While the page is free.
+		struct {
+			// Next page on the free list.
+			struct PageInfo *pp_link;
+			// Previous page on the free list.  The buddy
+			// allocator's free lists are doubly linked so that
+			// a buddy can be unlinked in O(1).
+			struct PageInfo *pp_prev;
+		};
+		// While the page is a page directory: the number of
+		// user pages mapped in that address space, and with PAE
+		// the page directory pointer table pointing at it.
+		struct {
+			uint32_t pp_nmapped;
+			pde_t *pp_pdpt;
+		};
+		// While the page is a page table: the page directory it
+		// is installed in, the index of its entry there, and how
+		// many of its PTEs are in use (not 0).
+		struct {
+			pde_t *pp_ptdir;
+			uint16_t pp_ptpdx;
+			uint16_t pp_ptcount;
+		};
+		// While the page is mapped with page_insert: the page
+		// table entries that map it (see kern/rmap.h).
+		pte_t *pp_rmap[2];
+	};
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
@@ -185,6 +239,49 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Order of the free block this page heads (valid with PP_FREE).
+	uint8_t pp_order;
+	// PP_* flags, see kern/pmap.h.
+	uint8_t pp_flags;
+};
+
+/*
+ * Physical memory statistics, maintained by kern/pmap.c in O(1) per
+ * operation.  Read by the 'meminfo' monitor command and returned to
+ * user programs by sys_meminfo.  All sizes are in pages.
+ */
+struct MemInfo {
+	uint32_t mi_total;		// Pages managed by the page allocator
+	uint32_t mi_free;		// Free pages, including cached ones
+	uint32_t mi_free_min;		// Low-water mark of mi_free
+	uint32_t mi_zeroed;		// Free pages already zeroed
+	uint32_t mi_zero_hits;		// ALLOC_ZERO served pre-zeroed
+	uint32_t mi_zero_misses;	// ALLOC_ZERO zeroed inline
+	uint32_t mi_zero_filled;	// Pages zeroed ahead of time
+	uint32_t mi_pgtables;		// Page-table pages in use
+	uint32_t mi_pgtables_max;	// High-water mark of mi_pgtables
+	uint32_t mi_pgtables_reclaimed;	// Page tables freed once emptied
+	uint32_t mi_mapped;		// User mappings in all address spaces
+	uint32_t mi_mapped_max;		// High-water mark of mi_mapped
+	uint32_t mi_swap_total;		// Swap slots (pages) on the swap disk
+	uint32_t mi_swap_used;		// Swap slots holding a page
+	uint32_t mi_swap_outs;		// Pages written out to swap
+	uint32_t mi_swap_ins;		// Pages read back from swap
+	uint32_t mi_zram_stored;	// Swapped-out pages kept compressed
+	uint32_t mi_zram_bytes;		// Their compressed size
+	uint32_t mi_zram_rejected;	// Pages that didn't compress enough
+	uint32_t mi_ksm_pages;		// Pages shared by same-page merging
+	uint32_t mi_ksm_scanned;	// Pages checked for a duplicate
+	uint32_t mi_ksm_merged;		// Pages replaced by a shared copy
+	uint32_t mi_ksm_unmerged;	// Shared pages copied again on write
+	uint32_t mi_cow_copied;		// Copy-on-write faults that copied
+	uint32_t mi_cow_reused;		// ... that took the last mapping back
+
+	// Filled in by sys_meminfo for the environment asked about.
+	uint32_t mi_env_resident;	// Pages mapped in its address space
+	uint32_t mi_env_faults;		// Page faults it took
+	uint32_t mi_env_faults_around;	// Pages resolved around them
 };
 
 #endif /* !__ASSEMBLER__ */
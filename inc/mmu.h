@@ -25,16 +25,42 @@
 // The PDX, PTX, PGOFF, and PGNUM macros decompose linear addresses as shown.
 // To construct a linear address la from PDX(la), PTX(la), and PGOFF(la),
 // use PGADDR(PDX(la), PTX(la), PGOFF(la)).
+//
+// With PAE paging (JOS_PAE), entries are 64 bits wide and a linear address
+// has a 2-bit index into a 4-entry page directory pointer table (PDPT),
+// then 9-bit page directory and page table indexes:
+//
+// +-2-+-----9-----+-------9-------+---------12----------+
+// |PDPT| Page Dir |   Page Table  | Offset within Page  |
+// +----+----------+---------------+---------------------+
+//  \--- PDX(la) -/ \-- PTX(la) --/ \---- PGOFF(la) ----/
+//
+// JOS allocates the four page directories of an address space as four
+// contiguous pages and uses them as a single 2048-entry page directory,
+// so PDX spans both upper indexes and the two-level code works unchanged.
+// The PDPT only exists for the benefit of %cr3 (see pgdir_cr3).
 
 // page number field of address
 #define PGNUM(la)	(((uintptr_t) (la)) >> PTXSHIFT)
 
+#ifdef JOS_PAE
+
+// page directory index
+#define PDX(la)		((((uintptr_t) (la)) >> PDXSHIFT) & 0x7FF)
+
+// page table index
+#define PTX(la)		((((uintptr_t) (la)) >> PTXSHIFT) & 0x1FF)
+
+#else
+
 // page directory index
 #define PDX(la)		((((uintptr_t) (la)) >> PDXSHIFT) & 0x3FF)
 
 // page table index
 #define PTX(la)		((((uintptr_t) (la)) >> PTXSHIFT) & 0x3FF)
 
+#endif
+
 // offset in page
 #define PGOFF(la)	(((uintptr_t) (la)) & 0xFFF)
 
@@ -42,17 +68,27 @@
 #define PGADDR(d, t, o)	((void*) ((d) << PDXSHIFT | (t) << PTXSHIFT | (o)))
 
 // Page directory and page table constants.
+#ifdef JOS_PAE
+#define NPDPENTRIES	4		// entries in a page directory pointer table
+#define NPDENTRIES	2048		// page directory entries, all 4 directories
+#define NPTENTRIES	512		// page table entries per page table
+#else
 #define NPDENTRIES	1024		// page directory entries per page directory
 #define NPTENTRIES	1024		// page table entries per page table
+#endif
 
 #define PGSIZE		4096		// bytes mapped by a page
 #define PGSHIFT		12		// log2(PGSIZE)
 
 #define PTSIZE		(PGSIZE*NPTENTRIES) // bytes mapped by a page directory entry
+#ifdef JOS_PAE
+#define PTSHIFT		21		// log2(PTSIZE)
+#else
 #define PTSHIFT		22		// log2(PTSIZE)
+#endif
 
 #define PTXSHIFT	12		// offset of PTX in a linear address
-#define PDXSHIFT	22		// offset of PDX in a linear address
+#define PDXSHIFT	PTSHIFT		// offset of PDX in a linear address
 
 // Page table/directory entry flags.
 #define PTE_P		0x001	// Present
@@ -72,8 +108,17 @@
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
+#ifdef JOS_PAE
+// No-execute, only honored once EFER_NXE is set (see mem_init_percpu)
+#define PTE_NX		0x8000000000000000ULL
+#endif
+
 // Address in page table or page directory entry
+#ifdef JOS_PAE
+#define PTE_ADDR(pte)	((physaddr_t) (pte) & 0x000FFFFFFFFFF000ULL)
+#else
 #define PTE_ADDR(pte)	((physaddr_t) (pte) & ~0xFFF)
+#endif
 
 // Control Register flags
 #define CR0_PE		0x00000001	// Protection Enable
@@ -89,13 +134,19 @@
 #define CR0_PG		0x80000000	// Paging
 
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
+#define CR4_PAE		0x00000020	// Physical Address Extension
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
 #define CR4_TSD		0x00000004	// Time Stamp Disable
 #define CR4_PVI		0x00000002	// Protected-Mode Virtual Interrupts
 #define CR4_VME		0x00000001	// V86 Mode Extensions
 
+// Extended Feature Enable Register (model-specific register MSR_EFER)
+#define MSR_EFER	0xC0000080
+#define EFER_NXE	0x00000800	// No-Execute Enable
+
 // Eflags register
 #define FL_CF		0x00000001	// Carry Flag
 #define FL_PF		0x00000004	// Parity Flag
@@ -223,7 +274,7 @@ struct Taskstate {
 	uintptr_t ts_esp2;
 	uint16_t ts_ss2;
 	uint16_t ts_padding3;
-	physaddr_t ts_cr3;	// Page directory base
+	uint32_t ts_cr3;		// Page directory base
 	uintptr_t ts_eip;	// Saved state from last task switch
 	uint32_t ts_eflags;
 	uint32_t ts_eax;	// More saved state (registers)
@@ -16,6 +16,13 @@ enum {
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_meminfo,
+	SYS_page_reserve,
+	SYS_page_alloc_range,
+	SYS_page_map_range,
+	SYS_page_unmap_range,
+	SYS_fork,
+	SYS_env_set_fault_around,
 	NSYSCALLS
 };
 
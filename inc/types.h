@@ -23,9 +23,14 @@ typedef unsigned long long uint64_t;
 // We use pointer types to represent virtual addresses,
 // uintptr_t to represent the numerical values of virtual addresses,
 // and physaddr_t to represent physical addresses.
+// With PAE paging (JOS_PAE), physical addresses are 64 bits long.
 typedef int32_t intptr_t;
 typedef uint32_t uintptr_t;
+#ifdef JOS_PAE
+typedef uint64_t physaddr_t;
+#else
 typedef uint32_t physaddr_t;
+#endif
 
 // Page numbers are 32 bits long.
 typedef uint32_t ppn_t;
@@ -15,6 +15,7 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
+#include <kern/tlb.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
@@ -173,10 +174,9 @@ static int
 env_setup_vm(struct Env *e)
 {
 	int i;
-	struct PageInfo *p = NULL;
 
-	// Allocate a page for the page directory
-	if (!(p = page_alloc(ALLOC_ZERO)))
+	// Allocate the page directory; pgdir_alloc sets up UVPT
+	if (!(e->env_pgdir = pgdir_alloc()))
 		return -E_NO_MEM;
 
 	// Now, set e->env_pgdir and initialize the page directory.
@@ -196,21 +196,11 @@ env_setup_vm(struct Env *e)
 	//    - The functions in kern/pmap.h are handy.
 
 	// LAB 3: Your code here.
-	e->env_pgdir = page2kva(p);
 	// cprintf("envid:%d pgdir:%p\n", e->env_id, e->env_pgdir);
-	uintptr_t * ppde = &kern_pgdir[PDX(UTOP)];
-	uintptr_t * eppde = &e->env_pgdir[PDX(UTOP)];
-	// fixme: shouldn't use magic number.
-	while(ppde != kern_pgdir+1024)
-	{
-		*eppde=*ppde;
-		ppde++;
-		eppde++;
-	}
-
-	// UVPT maps the env's own page table read-only.
-	// Permissions: kernel R, user R
-	e->env_pgdir[PDX(UVPT)] = PADDR(e->env_pgdir) | PTE_P | PTE_U;
+	// UVPT maps the env's own page table read-only, so leave it alone.
+	for (i = PDX(UTOP); i < NPDENTRIES; i++)
+		if (i < PDX(UVPT) || i >= PDX(UVPT + UVPTSIZE))
+			e->env_pgdir[i] = kern_pgdir[i];
 
 	return 0;
 }
@@ -275,6 +265,10 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	e->env_tf.tf_eflags |= FL_IF;
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	// Each page fault resolves just its own page, until asked.
+	e->env_fault_around = 0;
+	e->env_pgfaults = 0;
+	e->env_pgfaults_around = 0;
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
@@ -314,15 +308,21 @@ region_alloc(struct Env *e, void *va, size_t len)
 	// LAB 3: Your code here.
 	// @huangruizhe 20120410
 	struct PageInfo *p;
-	uint32_t offset = (uint32_t)ROUNDDOWN(va, PGSIZE);
-	uint32_t upper_bound = offset + len;
+	struct PtIter it;
+	uintptr_t offset = (uintptr_t)ROUNDDOWN(va, PGSIZE);
+	uintptr_t upper_bound = ROUNDUP((uintptr_t)va + len, PGSIZE);
+	pte_t *pte;
 	int r;
-	for(; offset < upper_bound; offset += PGSIZE)
+
+	pt_iter_init(&it, e->env_pgdir, (void *)offset, (upper_bound - offset) / PGSIZE);
+	while (it.pi_npages)
 	{
-		p = page_alloc(0);
+		if (!(pte = pt_iter_next(&it, &offset, PT_ITER_CREATE)))
+			panic("kern/env.c/region_alloc: out of memory.\n");
+		p = page_alloc(ALLOC_HIGHMEM | alloc_color(e->env_pgdir, (void *) offset));
 		if(p == NULL)
 			panic("kern/env.c/region_alloc: out of memory.\n");
-		r = page_insert(e->env_pgdir, p, (void *)offset, PTE_U | PTE_W);
+		r = page_insert_pte(e->env_pgdir, pte, p, (void *)offset, PTE_U | PTE_W);
 		if(r != 0)
 			panic("kern/env.c/region_alloc: %e\n", r);
 	}
@@ -389,7 +389,7 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
 	ph = (struct Proghdr *) ((uint8_t *) elfhdr + elfhdr->e_phoff);
 	eph = ph + elfhdr->e_phnum;
 
-	lcr3(PADDR(e->env_pgdir));
+	pgdir_load(e->env_pgdir);
 
 	for ( ;ph < eph; ph++) {
 		if (ph->p_type != ELF_PROG_LOAD)
@@ -408,7 +408,7 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
 	// LAB 3: Your code here.
 	region_alloc(e, (void *) USTACKTOP - PGSIZE, PGSIZE);
 
-	lcr3(PADDR(kern_pgdir));
+	pgdir_load(kern_pgdir);
 }
 
 //
@@ -439,46 +439,48 @@ env_create(uint8_t *binary, size_t size, enum EnvType type)
 void
 env_free(struct Env *e)
 {
-	pte_t *pt;
-	uint32_t pdeno, pteno;
-	physaddr_t pa;
+	struct PtIter it;
+	struct TlbBatch tb;
+	pte_t *pte;
+	uintptr_t va;
+	uint32_t pdeno;
 
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
 	// gets reused.
 	if (e == curenv)
-		lcr3(PADDR(kern_pgdir));
+		pgdir_load(kern_pgdir);
 
 	// Note the environment's demise.
 	cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
 	// Flush all mapped pages in the user portion of the address space
+	// (including swapped-out ones, to release their swap slots);
+	// unmapping the last PTE of a page table frees the page table
 	static_assert(UTOP % PTSIZE == 0);
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
-
-		// only look at mapped page tables
-		if (!(e->env_pgdir[pdeno] & PTE_P))
+	tlb_batch_init(&tb, e->env_pgdir);
+	pt_iter_init(&it, e->env_pgdir, 0, UTOP / PGSIZE);
+	while ((pte = pt_iter_next(&it, &va, PT_ITER_SKIP))) {
+		// leave the page tables still shared since sys_fork to the
+		// other address spaces
+		if (pgdir_release_shared_pt(e->env_pgdir, (void *) va))
 			continue;
+		if (*pte)
+			page_remove_pte(e->env_pgdir, (void *) va, pte, &tb);
+	}
+	tlb_batch_flush(&tb);
 
-		// find the pa and va of the page table
-		pa = PTE_ADDR(e->env_pgdir[pdeno]);
-		pt = (pte_t*) KADDR(pa);
-
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
+	// free the page tables that were empty already
+	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+		if (e->env_pgdir[pdeno] & PTE_P) {
+			page_decref(pa2page(PTE_ADDR(e->env_pgdir[pdeno])));
+			e->env_pgdir[pdeno] = 0;
 		}
-
-		// free the page table itself
-		e->env_pgdir[pdeno] = 0;
-		page_decref(pa2page(pa));
 	}
 
 	// free the page directory
-	pa = PADDR(e->env_pgdir);
+	pgdir_free(e->env_pgdir);
 	e->env_pgdir = 0;
-	page_decref(pa2page(pa));
 
 	// return the environment to the free list
 	e->env_status = ENV_FREE;
@@ -571,7 +573,7 @@ env_run(struct Env *e)
 	}
 	e->env_status = ENV_RUNNING;
 	e->env_runs++;
-	lcr3(PADDR(e->env_pgdir));
+	pgdir_load(e->env_pgdir);
 #ifdef LOCK_CODE
 	unlock_kernel();
 #endif
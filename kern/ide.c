@@ -0,0 +1,119 @@
+/* See COPYRIGHT for copyright information. */
+
+/*
+ * Minimal PIO-based (non-interrupt-driven) IDE driver for the primary
+ * channel.  The kernel runs with interrupts off, so every request
+ * simply polls the drive until it is done.
+ */
+
+#include <inc/x86.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/ide.h>
+
+#define IO_IDE1		0x1F0		// primary channel command block
+#define IO_IDE1_CTL	0x3F6		// primary channel device control
+
+#define IDE_BSY		0x80
+#define IDE_DRDY	0x40
+#define IDE_DF		0x20
+#define IDE_DRQ		0x08
+#define IDE_ERR		0x01
+
+#define IDE_CMD_READ	0x20
+#define IDE_CMD_WRITE	0x30
+#define IDE_CMD_IDENTIFY	0xEC
+
+#define IDE_CTL_NIEN	0x02		// no interrupts from the drive
+
+// Wait for the selected drive to become ready.  If check_error is set,
+// return -1 if the drive reports a fault.
+static int
+ide_wait_ready(bool check_error)
+{
+	int r;
+
+	while (((r = inb(IO_IDE1+7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY)
+		/* do nothing */;
+
+	if (check_error && (r & (IDE_DF|IDE_ERR)) != 0)
+		return -1;
+	return 0;
+}
+
+// Select the drive and the LBA28 address 'secno' for an 'nsecs'-sector
+// transfer.
+static void
+ide_select(int diskno, uint32_t secno, size_t nsecs)
+{
+	assert(nsecs <= 256 && secno < (1 << 28));
+
+	ide_wait_ready(0);
+	outb(IO_IDE1+2, nsecs);
+	outb(IO_IDE1+3, secno & 0xFF);
+	outb(IO_IDE1+4, (secno >> 8) & 0xFF);
+	outb(IO_IDE1+5, (secno >> 16) & 0xFF);
+	outb(IO_IDE1+6, 0xE0 | ((diskno & 1) << 4) | ((secno >> 24) & 0x0F));
+}
+
+//
+// Check whether disk 'diskno' is attached, and return its size in
+// sectors, or 0 if it is missing.
+//
+uint32_t
+ide_probe(int diskno)
+{
+	uint16_t id[256];
+	int i, r;
+
+	// The kernel polls, so keep the drives from raising IRQ 14.
+	outb(IO_IDE1_CTL, IDE_CTL_NIEN);
+
+	ide_wait_ready(0);
+	outb(IO_IDE1+6, 0xE0 | ((diskno & 1) << 4));
+	outb(IO_IDE1+7, IDE_CMD_IDENTIFY);
+
+	// A missing drive never raises DRQ; give up after a while.
+	for (i = 0; i < 1000; i++) {
+		r = inb(IO_IDE1+7);
+		if (r == 0 || (r & (IDE_DF|IDE_ERR)))
+			return 0;
+		if ((r & (IDE_BSY|IDE_DRQ)) == IDE_DRQ)
+			break;
+	}
+	if (i == 1000)
+		return 0;
+
+	insl(IO_IDE1+0, id, sizeof(id) / 4);
+	// Words 60-61: number of LBA28-addressable sectors.
+	return id[60] | (uint32_t) id[61] << 16;
+}
+
+int
+ide_read(int diskno, uint32_t secno, void *dst, size_t nsecs)
+{
+	ide_select(diskno, secno, nsecs);
+	outb(IO_IDE1+7, IDE_CMD_READ);
+
+	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
+		if (ide_wait_ready(1) < 0)
+			return -E_IO;
+		insl(IO_IDE1, dst, SECTSIZE/4);
+	}
+	return 0;
+}
+
+int
+ide_write(int diskno, uint32_t secno, const void *src, size_t nsecs)
+{
+	ide_select(diskno, secno, nsecs);
+	outb(IO_IDE1+7, IDE_CMD_WRITE);
+
+	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
+		if (ide_wait_ready(1) < 0)
+			return -E_IO;
+		outsl(IO_IDE1, src, SECTSIZE/4);
+	}
+	return 0;
+}
@@ -0,0 +1,23 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_IDE_H
+#define JOS_KERN_IDE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+#define SECTSIZE	512			// bytes per disk sector
+#define BLKSECTS	(PGSIZE / SECTSIZE)	// sectors per page
+
+// The primary IDE channel: disk 0 holds the boot image, disk 1 (if
+// present) is used as swap.
+#define IDE_SWAPDISK	1
+
+uint32_t ide_probe(int diskno);
+int	ide_read(int diskno, uint32_t secno, void *dst, size_t nsecs);
+int	ide_write(int diskno, uint32_t secno, const void *src, size_t nsecs);
+
+#endif // !JOS_KERN_IDE_H
@@ -7,6 +7,12 @@
 #include <kern/monitor.h>
 #include <kern/console.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
+#include <kern/rmap.h>
+#include <kern/swap.h>
+#include <kern/ksm.h>
+#include <kern/zeropage.h>
+#include <kern/uaccess.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/trap.h>
@@ -15,6 +21,7 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
+#include <kern/tlb.h>
 
 #define LOCK_CODE
 
@@ -38,10 +45,16 @@ i386_init(void)
 
 	// Lab 2 memory management initialization functions
 	mem_init();
+	kmem_init();
+	rmap_init();
+	swap_init();
+	ksm_init();
+	zero_page_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
 	trap_init();
+	uaccess_init();
 
 	// Lab 4 multiprocessor initialization functions
 	mp_init();
@@ -113,7 +126,8 @@ void
 mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir
-	lcr3(PADDR(kern_pgdir));
+	mem_init_percpu();
+	pgdir_load(kern_pgdir);
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
@@ -121,6 +135,11 @@ mp_main(void)
 	trap_init_percpu();
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
+	// Help set up the rest of pages[] before taking the kernel lock.
+	// Interrupts are off, so answer TLB shootdowns in between.
+	while (page_init_deferred())
+		tlb_shootdown_poll();
+
 	// Now that we have finished some basic setup, call sched_yield()
 	// to start running processes on this CPU.  But make sure that
 	// only one CPU can enter the scheduler at a time!
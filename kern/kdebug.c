@@ -6,6 +6,7 @@
 #include <kern/kdebug.h>
 #include <kern/pmap.h>
 #include <kern/env.h>
+#include <kern/uaccess.h>
 
 extern const struct Stab __STAB_BEGIN__[];	// Beginning of stabs table
 extern const struct Stab __STAB_END__[];	// End of stabs table
@@ -138,15 +139,17 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 		// __STABSTR_END__) in a structure located at virtual address
 		// USTABDATA.
 		const struct UserStabData *usd = (const struct UserStabData *) USTABDATA;
+		struct UserStabData kusd;
 
 		// Make sure this memory is valid.
-		// Return -1 if it is not.  Hint: Call user_mem_check.
-		// LAB 3: Your code here.
-
-		stabs = usd->stabs;
-		stab_end = usd->stab_end;
-		stabstr = usd->stabstr;
-		stabstr_end = usd->stabstr_end;
+		// Return -1 if it is not: copy_from_user checks it.
+		if (copy_from_user(&kusd, usd, sizeof(kusd)) < 0)
+			return -1;
+
+		stabs = kusd.stabs;
+		stab_end = kusd.stab_end;
+		stabstr = kusd.stabstr;
+		stabstr_end = kusd.stabstr_end;
 
 		// Make sure the STABS and string table memory is valid.
 		// LAB 3: Your code here.
@@ -0,0 +1,433 @@
+/* See COPYRIGHT for copyright information. */
+
+// Slab object allocator and kmalloc, built on top of the page allocator.
+
+#include <inc/assert.h>
+#include <inc/string.h>
+
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
+
+// A slab is a naturally aligned block of 2^kc_order pages.  It starts
+// with this header, followed by kc_nobjs objects of kc_size bytes.
+// Every page of a slab has PP_SLAB set and pp_order == kc_order in its
+// PageInfo, so the header can be found from any object.
+struct Slab {
+	struct KmemCache *sl_cache;
+	struct Slab *sl_next;		// Links on kc_partial
+	struct Slab *sl_prev;
+	void *sl_free;			// Free objects, linked through first word
+	int sl_inuse;			// Objects not on sl_free
+};
+
+#define KMEM_SLAB_MAX_ORDER	3	// Largest slab is 32KB
+#define KMEM_SLAB_MIN_OBJS	8	// Grow slabs until this many fit
+
+// struct KmemCaches are themselves allocated from this cache.
+static struct KmemCache kmem_cache_cache;
+
+// kmalloc_caches[i] holds the objects of size KMALLOC_MIN << i.
+#define KMALLOC_NCLASSES	8
+static struct KmemCache *kmalloc_caches[KMALLOC_NCLASSES];
+
+static void check_kmalloc(void);
+
+// --------------------------------------------------------------
+// Slabs.  All of these must be called with kc->kc_lock held.
+// --------------------------------------------------------------
+
+static void
+slab_link(struct KmemCache *kc, struct Slab *sl)
+{
+	sl->sl_prev = NULL;
+	sl->sl_next = kc->kc_partial;
+	if (kc->kc_partial)
+		kc->kc_partial->sl_prev = sl;
+	kc->kc_partial = sl;
+}
+
+static void
+slab_unlink(struct KmemCache *kc, struct Slab *sl)
+{
+	if (sl->sl_prev)
+		sl->sl_prev->sl_next = sl->sl_next;
+	else
+		kc->kc_partial = sl->sl_next;
+	if (sl->sl_next)
+		sl->sl_next->sl_prev = sl->sl_prev;
+	sl->sl_next = sl->sl_prev = NULL;
+}
+
+//
+// Allocate a new slab for kc, carve it into objects and put it on
+// kc_partial.  Returns NULL if out of memory.
+//
+static struct Slab *
+slab_create(struct KmemCache *kc)
+{
+	struct PageInfo *pp;
+	struct Slab *sl;
+	char *obj;
+	int i;
+
+	if (!(pp = page_alloc_npages(kc->kc_order, 0)))
+		return NULL;
+	for (i = 0; i < (1 << kc->kc_order); i++) {
+		pp[i].pp_flags |= PP_SLAB;
+		pp[i].pp_order = kc->kc_order;
+	}
+
+	sl = page2kva(pp);
+	sl->sl_cache = kc;
+	sl->sl_free = NULL;
+	sl->sl_inuse = 0;
+	// Link the objects so that the lowest address is handed out first.
+	obj = (char *) sl + kc->kc_hdrsize + (kc->kc_nobjs - 1) * kc->kc_size;
+	for (i = 0; i < kc->kc_nobjs; i++, obj -= kc->kc_size) {
+		*(void **) obj = sl->sl_free;
+		sl->sl_free = obj;
+	}
+	slab_link(kc, sl);
+	kc->kc_nslabs++;
+	return sl;
+}
+
+//
+// Give an empty slab, already off kc_partial, back to the page allocator.
+//
+static void
+slab_destroy(struct KmemCache *kc, struct Slab *sl)
+{
+	struct PageInfo *pp = pa2page(PADDR(sl));
+	int i;
+
+	assert(sl->sl_inuse == 0);
+	for (i = 0; i < (1 << kc->kc_order); i++)
+		pp[i].pp_flags &= ~PP_SLAB;
+	kc->kc_nslabs--;
+	page_free_npages(pp, kc->kc_order);
+}
+
+//
+// Return the slab that object 'obj' belongs to.
+//
+static struct Slab *
+obj2slab(void *obj)
+{
+	struct PageInfo *pp = pa2page(PADDR(obj));
+
+	assert(pp->pp_flags & PP_SLAB);
+	return ROUNDDOWN(obj, PGSIZE << pp->pp_order);
+}
+
+// --------------------------------------------------------------
+// Per-CPU object lists.
+// --------------------------------------------------------------
+
+//
+// Move up to KMEM_CPU_BATCH objects from kc's slabs to this CPU's
+// free list, allocating a new slab when no partial slab is left.
+//
+static void
+kmem_cpu_refill(struct KmemCache *kc, struct KmemCpu *kcpu)
+{
+	struct Slab *sl;
+	void *obj;
+
+	spin_lock(&kc->kc_lock);
+	while (kcpu->kcpu_count < KMEM_CPU_BATCH) {
+		if (!(sl = kc->kc_partial) && !(sl = slab_create(kc)))
+			break;
+		obj = sl->sl_free;
+		sl->sl_free = *(void **) obj;
+		if (++sl->sl_inuse == kc->kc_nobjs)
+			slab_unlink(kc, sl);
+		kc->kc_inuse++;
+
+		*(void **) obj = kcpu->kcpu_free;
+		kcpu->kcpu_free = obj;
+		kcpu->kcpu_count++;
+	}
+	spin_unlock(&kc->kc_lock);
+}
+
+//
+// Give n objects from this CPU's free list back to their slabs.
+// A slab that becomes empty is freed, unless it is kc's last partial slab.
+//
+static void
+kmem_cpu_drain(struct KmemCache *kc, struct KmemCpu *kcpu, int n)
+{
+	struct Slab *sl;
+	void *obj;
+
+	spin_lock(&kc->kc_lock);
+	while (n-- > 0 && (obj = kcpu->kcpu_free)) {
+		kcpu->kcpu_free = *(void **) obj;
+		kcpu->kcpu_count--;
+
+		sl = obj2slab(obj);
+		assert(sl->sl_cache == kc);
+		if (sl->sl_inuse == kc->kc_nobjs)
+			slab_link(kc, sl);
+		*(void **) obj = sl->sl_free;
+		sl->sl_free = obj;
+		kc->kc_inuse--;
+		if (--sl->sl_inuse == 0 && (sl->sl_prev || sl->sl_next)) {
+			slab_unlink(kc, sl);
+			slab_destroy(kc, sl);
+		}
+	}
+	spin_unlock(&kc->kc_lock);
+}
+
+// --------------------------------------------------------------
+// Object caches.
+// --------------------------------------------------------------
+
+//
+// Fill in kc for objects of 'size' bytes aligned to 'align',
+// which must be a power of two.  Picks the smallest slab order that
+// holds KMEM_SLAB_MIN_OBJS objects, up to KMEM_SLAB_MAX_ORDER.
+// kc->kc_nobjs is 0 if the objects don't fit in any slab.
+//
+static void
+kmem_cache_setup(struct KmemCache *kc, const char *name, size_t size, size_t align)
+{
+	int order;
+
+	memset(kc, 0, sizeof(*kc));
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	kc->kc_name = name;
+	kc->kc_align = align;
+	kc->kc_size = ROUNDUP(MAX(size, sizeof(void *)), align);
+	kc->kc_hdrsize = ROUNDUP(sizeof(struct Slab), align);
+	for (order = 0; order < KMEM_SLAB_MAX_ORDER; order++)
+		if (((PGSIZE << order) - kc->kc_hdrsize) / kc->kc_size >= KMEM_SLAB_MIN_OBJS)
+			break;
+	kc->kc_order = order;
+	if (kc->kc_hdrsize < (PGSIZE << order))
+		kc->kc_nobjs = ((PGSIZE << order) - kc->kc_hdrsize) / kc->kc_size;
+	spin_initlock(&kc->kc_lock);
+}
+
+//
+// Create a cache of objects of 'size' bytes, aligned to 'align' bytes
+// (a power of two; pass KMEM_CACHELINE to keep objects from sharing
+// cache lines).
+//
+// Returns NULL if out of memory, or if the alignment is not a power
+// of two or the objects are too large for a slab.
+//
+struct KmemCache *
+kmem_cache_create(const char *name, size_t size, size_t align)
+{
+	struct KmemCache *kc;
+
+	if (align & (align - 1))
+		return NULL;
+	if (!(kc = kmem_cache_alloc(&kmem_cache_cache)))
+		return NULL;
+	kmem_cache_setup(kc, name, size, align);
+	if (!kc->kc_nobjs) {
+		kmem_cache_free(&kmem_cache_cache, kc);
+		return NULL;
+	}
+	return kc;
+}
+
+//
+// Destroy a cache.  Every object must have been freed already.
+//
+static void
+kmem_cache_destroy(struct KmemCache *kc)
+{
+	struct Slab *sl;
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		kmem_cpu_drain(kc, &kc->kc_cpu[i], kc->kc_cpu[i].kcpu_count);
+
+	spin_lock(&kc->kc_lock);
+	assert(kc->kc_inuse == 0);
+	while ((sl = kc->kc_partial)) {
+		slab_unlink(kc, sl);
+		slab_destroy(kc, sl);
+	}
+	spin_unlock(&kc->kc_lock);
+	kmem_cache_free(&kmem_cache_cache, kc);
+}
+
+//
+// Allocate one object from kc.  The contents are undefined.
+// Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct KmemCache *kc)
+{
+	struct KmemCpu *kcpu = &kc->kc_cpu[cpunum()];
+	void *obj;
+
+	if (!kcpu->kcpu_free)
+		kmem_cpu_refill(kc, kcpu);
+	if (!(obj = kcpu->kcpu_free))
+		return NULL;
+	kcpu->kcpu_free = *(void **) obj;
+	kcpu->kcpu_count--;
+	return obj;
+}
+
+//
+// Return an object to kc.  It lands on this CPU's free list, which is
+// drained back to the slabs in batches once it grows too long.
+//
+void
+kmem_cache_free(struct KmemCache *kc, void *obj)
+{
+	struct KmemCpu *kcpu = &kc->kc_cpu[cpunum()];
+
+	if (kcpu->kcpu_count >= KMEM_CPU_MAX)
+		kmem_cpu_drain(kc, kcpu, KMEM_CPU_BATCH);
+	*(void **) obj = kcpu->kcpu_free;
+	kcpu->kcpu_free = obj;
+	kcpu->kcpu_count++;
+}
+
+// --------------------------------------------------------------
+// kmalloc.
+// --------------------------------------------------------------
+
+//
+// Allocate 'size' bytes.  Requests up to KMALLOC_MAX bytes come from
+// the power-of-two size class caches (aligned to the class size, or to
+// a cache line for the larger classes); anything bigger gets its own
+// block of pages.  Returns NULL if out of memory.
+//
+void *
+kmalloc(size_t size)
+{
+	struct PageInfo *pp;
+	int i;
+
+	if (size == 0)
+		return NULL;
+	if (size <= KMALLOC_MAX) {
+		for (i = 0; (KMALLOC_MIN << i) < size; i++)
+			/* do nothing */;
+		return kmem_cache_alloc(kmalloc_caches[i]);
+	}
+
+	for (i = 0; (PGSIZE << i) < size; i++)
+		if (i == PAGE_MAX_ORDER)
+			return NULL;
+	if (!(pp = page_alloc_npages(i, 0)))
+		return NULL;
+	pp->pp_flags |= PP_KMALLOC;
+	pp->pp_order = i;
+	return page2kva(pp);
+}
+
+//
+// Free memory returned by kmalloc.  kfree(NULL) does nothing.
+//
+void
+kfree(void *ptr)
+{
+	struct PageInfo *pp;
+
+	if (!ptr)
+		return;
+	pp = pa2page(PADDR(ptr));
+	if (pp->pp_flags & PP_SLAB) {
+		kmem_cache_free(obj2slab(ptr)->sl_cache, ptr);
+		return;
+	}
+	assert((pp->pp_flags & PP_KMALLOC) && ptr == page2kva(pp));
+	pp->pp_flags &= ~PP_KMALLOC;
+	page_free_npages(pp, pp->pp_order);
+}
+
+//
+// Set up the cache of caches and the kmalloc size classes.
+// Must be called after mem_init.
+//
+void
+kmem_init(void)
+{
+	static const char *const names[KMALLOC_NCLASSES] = {
+		"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+		"kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+	};
+	size_t size;
+	int i;
+
+	static_assert(KMALLOC_MIN << (KMALLOC_NCLASSES - 1) == KMALLOC_MAX);
+
+	kmem_cache_setup(&kmem_cache_cache, "kmem_cache",
+			 sizeof(struct KmemCache), KMEM_CACHELINE);
+	for (i = 0; i < KMALLOC_NCLASSES; i++) {
+		size = KMALLOC_MIN << i;
+		kmalloc_caches[i] = kmem_cache_create(names[i], size,
+						      MIN(size, KMEM_CACHELINE));
+		if (!kmalloc_caches[i])
+			panic("kmem_init: cannot create %s", names[i]);
+	}
+
+	check_kmalloc();
+}
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+static void
+check_kmalloc(void)
+{
+	struct KmemCache *kc;
+	uint8_t *p[64], *big;
+	size_t size;
+	int i, j;
+
+	// objects are aligned, distinct, and don't overlap
+	assert((kc = kmem_cache_create("check", 100, KMEM_CACHELINE)));
+	assert(kc->kc_size == 128 && kc->kc_nobjs >= KMEM_SLAB_MIN_OBJS);
+	for (i = 0; i < 64; i++) {
+		assert((p[i] = kmem_cache_alloc(kc)));
+		assert((uintptr_t) p[i] % KMEM_CACHELINE == 0);
+		memset(p[i], i, 100);
+	}
+	for (i = 0; i < 64; i++)
+		for (j = 0; j < 100; j++)
+			assert(p[i][j] == i);
+	assert(kc->kc_nslabs >= 64 / kc->kc_nobjs);
+
+	// freed objects get reused
+	kmem_cache_free(kc, p[7]);
+	assert(kmem_cache_alloc(kc) == p[7]);
+	for (i = 0; i < 64; i++)
+		kmem_cache_free(kc, p[i]);
+	kmem_cache_destroy(kc);
+
+	// bad alignments and oversized objects are refused
+	assert(!kmem_cache_create("check", 100, 48));
+	assert(!kmem_cache_create("check", 64 * PGSIZE, KMEM_CACHELINE));
+
+	// every size class is naturally aligned up to a cache line
+	for (size = 1; size <= KMALLOC_MAX; size = size * 2 + 1) {
+		assert((p[0] = kmalloc(size)));
+		assert((uintptr_t) p[0] % MIN(ROUNDUP(size, KMALLOC_MIN), KMEM_CACHELINE) == 0);
+		memset(p[0], 0xa5, size);
+		kfree(p[0]);
+	}
+
+	// large requests get whole pages
+	assert((big = kmalloc(3 * PGSIZE)));
+	assert((uintptr_t) big % (4 * PGSIZE) == 0);
+	memset(big, 0, 3 * PGSIZE);
+	kfree(big);
+	kfree(NULL);
+	assert(!kmalloc(0));
+
+	cprintf("check_kmalloc() succeeded!\n");
+}
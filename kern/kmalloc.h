@@ -0,0 +1,59 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KMALLOC_H
+#define JOS_KERN_KMALLOC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+#define KMEM_CACHELINE	64		// Assumed size of a CPU cache line
+
+// kmalloc size classes are the powers of two in [KMALLOC_MIN, KMALLOC_MAX].
+// Larger requests are served with whole pages from page_alloc_npages.
+#define KMALLOC_MIN	16
+#define KMALLOC_MAX	2048
+
+// Objects a CPU may keep on its private free list before handing
+// KMEM_CPU_BATCH of them back to their slabs.
+#define KMEM_CPU_MAX	32
+#define KMEM_CPU_BATCH	(KMEM_CPU_MAX / 2)
+
+struct Slab;
+
+// Per-CPU object cache of a KmemCache.  Objects are linked through
+// their first word.
+struct KmemCpu {
+	void *kcpu_free;		// Free objects owned by this CPU
+	int kcpu_count;			// Length of kcpu_free
+} __attribute__((__aligned__(KMEM_CACHELINE)));
+
+struct KmemCache {
+	const char *kc_name;
+	size_t kc_size;			// Object size, a multiple of kc_align
+	size_t kc_align;		// Object alignment
+	int kc_order;			// Each slab is 2^kc_order pages
+	int kc_nobjs;			// Objects per slab
+	size_t kc_hdrsize;		// Slab header, rounded up to kc_align
+
+	struct spinlock kc_lock;	// Protects the slab lists
+	struct Slab *kc_partial;	// Slabs with free objects
+	uint32_t kc_nslabs;		// Slabs currently allocated
+	uint32_t kc_inuse;		// Objects handed out (incl. per-CPU)
+
+	struct KmemCpu kc_cpu[NCPU];
+};
+
+void	kmem_init(void);
+
+struct KmemCache *kmem_cache_create(const char *name, size_t size, size_t align);
+void	*kmem_cache_alloc(struct KmemCache *kc);
+void	kmem_cache_free(struct KmemCache *kc, void *obj);
+
+void	*kmalloc(size_t size);
+void	kfree(void *ptr);
+
+#endif	// !JOS_KERN_KMALLOC_H
@@ -0,0 +1,315 @@
+/* See COPYRIGHT for copyright information. */
+
+/*
+ * Kernel same-page merging.
+ *
+ * On every clock tick, ksm_tick looks at a few more user pages, moving
+ * a cursor through all address spaces.  A page mapped only once is
+ * checksummed and looked up in two hash tables:
+ *
+ *  - the stable table holds merged pages (PP_KSM).  They are read-only
+ *    everywhere, so their contents and checksums never change.  An
+ *    identical page is replaced by the merged one and freed.
+ *  - the unstable table holds the other pages seen during this pass
+ *    over memory.  They may have changed since, so a hit is compared
+ *    byte by byte; if it still matches, the earlier page becomes a
+ *    merged page and the new one is replaced by it.  The table is
+ *    emptied whenever the cursor starts over.
+ *
+ * Merged pages are mapped without PTE_W and with PTE_COW.  A write
+ * fault on one is resolved in the kernel by ksm_unmerge, which gives
+ * the faulting address space a private copy again.
+ */
+
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/ksm.h>
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/kmalloc.h>
+#include <kern/rmap.h>
+
+#define KSM_NBUCKETS		256
+#define KSM_MAX_UNSTABLE	1024	// Candidates remembered per pass
+
+struct KsmItem {
+	struct KsmItem *ki_next;	// Next item in the same bucket
+	uint32_t ki_hash;		// Checksum of the page's contents
+	struct PageInfo *ki_page;
+	envid_t ki_env;			// Unstable items: where ki_page
+	uintptr_t ki_va;		// was mapped when it was seen
+};
+
+static struct KmemCache *ksm_item_cache;
+static struct KsmItem *ksm_stable[KSM_NBUCKETS];
+static struct KsmItem *ksm_unstable[KSM_NBUCKETS];
+static int ksm_nunstable;
+
+// The scan cursor: the next page ksm_tick looks at.
+static uint32_t ksm_scan_env;
+static uintptr_t ksm_scan_va;
+
+void
+ksm_init(void)
+{
+	ksm_item_cache = kmem_cache_create("ksm_item", sizeof(struct KsmItem),
+					   sizeof(void *));
+	if (!ksm_item_cache)
+		panic("ksm_init: cannot create item cache");
+}
+
+static uint32_t
+ksm_hash(struct PageInfo *pp)
+{
+	uint32_t *p = kmap(pp);
+	uint32_t hash = 2166136261U;
+	int i;
+
+	for (i = 0; i < PGSIZE / 4; i++)
+		hash = (hash ^ p[i]) * 16777619;
+	kunmap(p);
+	return hash;
+}
+
+static bool
+ksm_same(struct PageInfo *a, struct PageInfo *b)
+{
+	void *pa = kmap(a), *pb = kmap(b);
+	bool same = memcmp(pa, pb, PGSIZE) == 0;
+
+	kunmap(pb);
+	kunmap(pa);
+	return same;
+}
+
+// Whether e's pages may be looked at.  An env that is current on
+// another CPU has its page directory loaded there: it may be writing
+// to its pages, or have their PTEs cached in that CPU's TLB.  This
+// holds whatever env_status says, as trap() marks an env runnable
+// before that CPU even gets the kernel lock.
+static bool
+ksm_env_ok(struct Env *e)
+{
+	int i;
+
+	if (e->env_status == ENV_FREE || !e->env_pgdir)
+		return false;
+	for (i = 0; i < ncpu; i++)
+		if (&cpus[i] != thiscpu && cpus[i].cpu_env == e)
+			return false;
+	return true;
+}
+
+//
+// Take a merged page out of the stable table, because it is being
+// freed or is private to one address space again.
+//
+void
+ksm_page_release(struct PageInfo *pp)
+{
+	struct KsmItem *ki, **kip;
+
+	assert(pp->pp_flags & PP_KSM);
+	kip = &ksm_stable[ksm_hash(pp) % KSM_NBUCKETS];
+	for (; (ki = *kip); kip = &ki->ki_next)
+		if (ki->ki_page == pp) {
+			*kip = ki->ki_next;
+			kmem_cache_free(ksm_item_cache, ki);
+			break;
+		}
+	pp->pp_flags &= ~PP_KSM;
+	meminfo_add(&meminfo.mi_ksm_pages, -1, NULL);
+}
+
+static void
+ksm_unstable_flush(void)
+{
+	struct KsmItem *ki;
+	int i;
+
+	for (i = 0; i < KSM_NBUCKETS; i++)
+		while ((ki = ksm_unstable[i])) {
+			ksm_unstable[i] = ki->ki_next;
+			kmem_cache_free(ksm_item_cache, ki);
+		}
+	ksm_nunstable = 0;
+}
+
+// Return the env that still maps unstable item ki's page, once, where
+// it was seen, and store the PTE in *pte_store.  Otherwise return NULL.
+static struct Env *
+ksm_unstable_env(struct KsmItem *ki, pte_t **pte_store)
+{
+	struct Env *e = &envs[ENVX(ki->ki_env)];
+	pte_t *pte;
+
+	if (e->env_id != ki->ki_env || !ksm_env_ok(e)
+	    || pgdir_pt_shared(e->env_pgdir, (void *) ki->ki_va))
+		return NULL;
+	pte = pgdir_walk(e->env_pgdir, (void *) ki->ki_va, 0);
+	if (!pte || !(*pte & PTE_P) || pa2page(PTE_ADDR(*pte)) != ki->ki_page
+	    || ki->ki_page->pp_ref != 1 || (ki->ki_page->pp_flags & PP_KSM))
+		return NULL;
+	*pte_store = pte;
+	return e;
+}
+
+// The permissions a merged page is mapped with, given the old PTE.
+static int
+ksm_perm(pte_t pte)
+{
+	int perm = pte & PTE_SYSCALL;
+
+	if (perm & PTE_W)
+		perm = (perm & ~PTE_W) | PTE_COW;
+	return perm;
+}
+
+// Replace the page that *pte maps at va with merged page kpp.
+// The page stays unmerged if its reverse map needs memory and there is none.
+static void
+ksm_merge(pde_t *pgdir, uintptr_t va, pte_t *pte, struct PageInfo *kpp)
+{
+	struct PageInfo *pp = pa2page(PTE_ADDR(*pte));
+
+	if (rmap_add(kpp, pte) < 0)
+		return;
+	rmap_remove(pp, pte);
+	kpp->pp_ref++;
+	*pte = page2pa(kpp) | ksm_perm(*pte);
+	tlb_invalidate(pgdir, (void *) va);
+	page_decref(pp);
+	meminfo_add(&meminfo.mi_ksm_merged, 1, NULL);
+}
+
+static void
+ksm_scan_page(struct Env *e, uintptr_t va, pte_t *pte)
+{
+	struct PageInfo *pp = pa2page(PTE_ADDR(*pte));
+	struct KsmItem *ki, **kip;
+	struct Env *owner;
+	pte_t *opte;
+	uint32_t hash, bucket;
+
+	if (pp->pp_ref != 1 || (pp->pp_flags & (PP_KSM|PP_PGTABLE)))
+		return;
+	meminfo_add(&meminfo.mi_ksm_scanned, 1, NULL);
+	hash = ksm_hash(pp);
+	bucket = hash % KSM_NBUCKETS;
+
+	for (ki = ksm_stable[bucket]; ki; ki = ki->ki_next)
+		if (ki->ki_hash == hash && ksm_same(ki->ki_page, pp)) {
+			ksm_merge(e->env_pgdir, va, pte, ki->ki_page);
+			return;
+		}
+
+	for (kip = &ksm_unstable[bucket]; (ki = *kip); kip = &ki->ki_next) {
+		if (ki->ki_hash != hash || ki->ki_page == pp
+		    || !(owner = ksm_unstable_env(ki, &opte))
+		    || !ksm_same(ki->ki_page, pp))
+			continue;
+
+		// The earlier page becomes the merged copy.
+		*kip = ki->ki_next;
+		ksm_nunstable--;
+		*opte = (*opte & ~PTE_SYSCALL) | ksm_perm(*opte);
+		tlb_invalidate(owner->env_pgdir, (void *) ki->ki_va);
+		ki->ki_page->pp_flags |= PP_KSM;
+		ki->ki_next = ksm_stable[bucket];
+		ksm_stable[bucket] = ki;
+		meminfo_add(&meminfo.mi_ksm_pages, 1, NULL);
+
+		ksm_merge(e->env_pgdir, va, pte, ki->ki_page);
+		return;
+	}
+
+	if (ksm_nunstable >= KSM_MAX_UNSTABLE
+	    || !(ki = kmem_cache_alloc(ksm_item_cache)))
+		return;
+	ki->ki_hash = hash;
+	ki->ki_page = pp;
+	ki->ki_env = e->env_id;
+	ki->ki_va = va;
+	ki->ki_next = ksm_unstable[bucket];
+	ksm_unstable[bucket] = ki;
+	ksm_nunstable++;
+}
+
+//
+// Scan the next KSM_SCAN_BATCH user pages for merging.
+// Called on every clock tick.
+//
+void
+ksm_tick(void)
+{
+	struct Env *e;
+	pte_t *pte;
+	uintptr_t va;
+	int n, nenvs;
+
+	if (!ksm_item_cache)
+		return;
+
+	for (n = nenvs = 0; n < KSM_SCAN_BATCH && nenvs < NENV; ) {
+		e = &envs[ksm_scan_env];
+		if (ksm_scan_va >= UTOP || !ksm_env_ok(e)) {
+			if (++ksm_scan_env == NENV) {
+				ksm_scan_env = 0;
+				ksm_unstable_flush();
+			}
+			ksm_scan_va = 0;
+			nenvs++;
+			continue;
+		}
+		// As for swap_out, pages in shared page tables are left be.
+		if (!(e->env_pgdir[PDX(ksm_scan_va)] & PTE_P)
+		    || pgdir_pt_shared(e->env_pgdir, (void *) ksm_scan_va)) {
+			ksm_scan_va = ROUNDUP(ksm_scan_va + 1, PTSIZE);
+			continue;
+		}
+
+		va = ksm_scan_va;
+		ksm_scan_va += PGSIZE;
+		pte = pgdir_walk(e->env_pgdir, (void *) va, 0);
+		if ((*pte & (PTE_P|PTE_U)) == (PTE_P|PTE_U)) {
+			ksm_scan_page(e, va, pte);
+			n++;
+		}
+	}
+}
+
+//
+// If va in pgdir maps a merged page copy-on-write, make it private and
+// writable again.
+// Returns 1 if it did, 0 if va does not map a merged page that way,
+// and -E_NO_MEM if there was no memory for the copy.
+//
+int
+ksm_unmerge(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	int perm, r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	pte = pgdir_walk(pgdir, va, 0);
+	if (!pte || (*pte & (PTE_P|PTE_COW)) != (PTE_P|PTE_COW))
+		return 0;
+	pp = pa2page(PTE_ADDR(*pte));
+	if (!(pp->pp_flags & PP_KSM))
+		return 0;
+	perm = ((*pte & PTE_SYSCALL) & ~PTE_COW) | PTE_W;
+
+	if (pp->pp_ref == 1) {
+		// The last mapping simply takes the page back.
+		ksm_page_release(pp);
+		*pte = page2pa(pp) | perm;
+		tlb_invalidate(pgdir, va);
+	} else if ((r = page_copy_insert(pgdir, pp, va, perm, 0)) < 0)
+		return r;
+	meminfo_add(&meminfo.mi_ksm_unmerged, 1, NULL);
+	return 1;
+}
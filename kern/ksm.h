@@ -0,0 +1,23 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KSM_H
+#define JOS_KERN_KSM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/memlayout.h>
+
+// Merged pages are mapped read-only with the copy-on-write bit that
+// lib/fork.c uses; the kernel itself breaks the sharing on a write.
+#define PTE_COW		0x800
+
+// Pages looked at per clock tick.
+#define KSM_SCAN_BATCH	32
+
+void	ksm_init(void);
+void	ksm_tick(void);
+int	ksm_unmerge(pde_t *pgdir, void *va);
+void	ksm_page_release(struct PageInfo *pp);
+
+#endif // !JOS_KERN_KSM_H
@@ -0,0 +1,116 @@
+/* See COPYRIGHT for copyright information. */
+
+/*
+ * A small LZ77 compressor in the style of LZJB, for pages.
+ *
+ * The output is a sequence of groups: a control byte, then eight items,
+ * one per control bit starting with the lowest.  A clear bit is a
+ * literal byte.  A set bit is a two-byte back reference: the top
+ * LZ_MATCH_BITS bits are the match length minus LZ_MATCH_MIN, the
+ * other bits how far back the match starts.
+ */
+
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/lz.h>
+
+#define LZ_MATCH_BITS	6
+#define LZ_MATCH_MIN	3
+#define LZ_MATCH_MAX	((1 << LZ_MATCH_BITS) + (LZ_MATCH_MIN - 1))
+#define LZ_OFFSET_MASK	((1 << (16 - LZ_MATCH_BITS)) - 1)
+#define LZ_NHASH	1024
+
+//
+// Compress slen bytes at src into at most dmax bytes at dst.
+// Returns the compressed length, or slen if the data doesn't fit.
+//
+size_t
+lz_compress(const void *src, void *dst, size_t slen, size_t dmax)
+{
+	// Offsets into src of the last position with each hash.
+	// Callers are serialized by the big kernel lock.
+	static uint16_t lz_last[LZ_NHASH];
+	const uint8_t *s = src, *send = s + slen, *cpy;
+	uint8_t *d = dst, *dend = d + dmax, *ctrl = NULL;
+	uint32_t hash, off;
+	int mask = 1 << 7, len;
+
+	assert(slen <= 0x10000);
+	memset(lz_last, 0, sizeof(lz_last));
+
+	while (s < send) {
+		if ((mask <<= 1) == (1 << 8)) {
+			// Room for a whole group.
+			if (d + 1 + 2 * 8 > dend)
+				return slen;
+			mask = 1;
+			ctrl = d;
+			*d++ = 0;
+		}
+		if (s > send - LZ_MATCH_MAX) {
+			*d++ = *s++;
+			continue;
+		}
+
+		hash = (s[0] << 16) + (s[1] << 8) + s[2];
+		hash += hash >> 9;
+		hash += hash >> 5;
+		hash &= LZ_NHASH - 1;
+		off = (s - (const uint8_t *) src - lz_last[hash]) & LZ_OFFSET_MASK;
+		lz_last[hash] = s - (const uint8_t *) src;
+		cpy = s - off;
+
+		if (off && cpy >= (const uint8_t *) src
+		    && s[0] == cpy[0] && s[1] == cpy[1] && s[2] == cpy[2]) {
+			*ctrl |= mask;
+			for (len = LZ_MATCH_MIN; len < LZ_MATCH_MAX; len++)
+				if (s[len] != cpy[len])
+					break;
+			*d++ = ((len - LZ_MATCH_MIN) << (8 - LZ_MATCH_BITS)) | (off >> 8);
+			*d++ = off;
+			s += len;
+		} else
+			*d++ = *s++;
+	}
+	return d - (uint8_t *) dst;
+}
+
+//
+// Decompress slen bytes at src, which must expand to exactly dlen bytes
+// at dst.  Returns 0 on success, -1 if the data is corrupt.
+//
+int
+lz_decompress(const void *src, void *dst, size_t slen, size_t dlen)
+{
+	const uint8_t *s = src, *send = s + slen;
+	uint8_t *d = dst, *dend = d + dlen, *cpy;
+	int mask = 1 << 7, ctrl = 0, len;
+
+	while (d < dend) {
+		if ((mask <<= 1) == (1 << 8)) {
+			if (s >= send)
+				return -1;
+			mask = 1;
+			ctrl = *s++;
+		}
+		if (ctrl & mask) {
+			if (s + 2 > send)
+				return -1;
+			len = (s[0] >> (8 - LZ_MATCH_BITS)) + LZ_MATCH_MIN;
+			cpy = d - (((s[0] << 8) | s[1]) & LZ_OFFSET_MASK);
+			s += 2;
+			if (cpy < (uint8_t *) dst || cpy == d)
+				return -1;
+			if (len > dend - d)
+				len = dend - d;
+			while (len-- > 0)
+				*d++ = *cpy++;
+		} else {
+			if (s >= send)
+				return -1;
+			*d++ = *s++;
+		}
+	}
+	return 0;
+}
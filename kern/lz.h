@@ -0,0 +1,14 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_LZ_H
+#define JOS_KERN_LZ_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+size_t	lz_compress(const void *src, void *dst, size_t slen, size_t dmax);
+int	lz_decompress(const void *src, void *dst, size_t slen, size_t dlen);
+
+#endif // !JOS_KERN_LZ_H
@@ -8,6 +8,7 @@
 #include <inc/x86.h>
 #include <inc/mmu.h>
 #include <kern/env.h>
+#include <kern/pmap.h>
 
 #include <kern/console.h>
 #include <kern/monitor.h>
@@ -29,6 +30,7 @@ static struct Command commands[] = {
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
 	{ "ct", "Continue", mon_continue },
 	{ "si", "Single Step", mon_step },
+	{ "meminfo", "Display physical memory statistics", mon_meminfo },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -60,6 +62,40 @@ mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_meminfo(int argc, char **argv, struct Trapframe *tf)
+{
+	struct MemInfo mi;
+	uint32_t nzero;
+	int i;
+
+	meminfo_read(&mi, NULL);
+	cprintf("Pages:       %u total, %u free (low-water %u)\n",
+		mi.mi_total, mi.mi_free, mi.mi_free_min);
+	nzero = mi.mi_zero_hits + mi.mi_zero_misses;
+	cprintf("Pre-zeroed:  %u pages, %u filled, %u/%u hits (%u%%)\n",
+		mi.mi_zeroed, mi.mi_zero_filled, mi.mi_zero_hits, nzero,
+		nzero ? mi.mi_zero_hits * 100 / nzero : 0);
+	cprintf("Page tables: %u (max %u, %u reclaimed)\n", mi.mi_pgtables,
+		mi.mi_pgtables_max, mi.mi_pgtables_reclaimed);
+	cprintf("Mappings:    %u (max %u)\n", mi.mi_mapped, mi.mi_mapped_max);
+	cprintf("Swap:        %u/%u slots used, %u out, %u in\n",
+		mi.mi_swap_used, mi.mi_swap_total, mi.mi_swap_outs, mi.mi_swap_ins);
+	cprintf("Compressed:  %u pages in %uK, %u rejected\n",
+		mi.mi_zram_stored, mi.mi_zram_bytes / 1024, mi.mi_zram_rejected);
+	cprintf("Merged:      %u pages, %u scanned, %u merged, %u unmerged\n",
+		mi.mi_ksm_pages, mi.mi_ksm_scanned, mi.mi_ksm_merged,
+		mi.mi_ksm_unmerged);
+	cprintf("COW faults:  %u copied, %u reused\n",
+		mi.mi_cow_copied, mi.mi_cow_reused);
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_status != ENV_FREE)
+			cprintf("  env %08x: %u pages resident, %u faults, %u pages around\n",
+				envs[i].env_id, pgdir_nmapped(envs[i].env_pgdir),
+				envs[i].env_pgfaults, envs[i].env_pgfaults_around);
+	return 0;
+}
+
 int move_up_arg(uint32_t* addr, int times)
 {
 	addr += times;
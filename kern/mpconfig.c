@@ -24,7 +24,7 @@ __attribute__ ((aligned(PGSIZE)));
 
 struct mp {             // floating pointer [MP 4.1]
 	uint8_t signature[4];           // "_MP_"
-	physaddr_t physaddr;            // phys addr of MP config table
+	uint32_t physaddr;              // phys addr of MP config table
 	uint8_t length;                 // 1
 	uint8_t specrev;                // [14]
 	uint8_t checksum;               // all bytes must add up to 0
@@ -39,10 +39,10 @@ struct mpconf {         // configuration table header [MP 4.2]
 	uint8_t version;                // [14]
 	uint8_t checksum;               // all bytes must add up to 0
 	uint8_t product[20];            // product id
-	physaddr_t oemtable;            // OEM table pointer
+	uint32_t oemtable;              // OEM table pointer
 	uint16_t oemlength;             // OEM table length
 	uint16_t entry;                 // entry count
-	physaddr_t lapicaddr;           // address of local APIC
+	uint32_t lapicaddr;             // address of local APIC
 	uint16_t xlength;               // extended table length
 	uint8_t xchecksum;              // extended table checksum
 	uint8_t reserved;
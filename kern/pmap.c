@@ -10,15 +10,141 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/kmalloc.h>
+#include <kern/swap.h>
+#include <kern/ksm.h>
+#include <kern/rmap.h>
+#include <kern/zeropage.h>
+#include <kern/tlb.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
+size_t npages_lowmem;		// Amount of it mapped at KERNBASE (in pages)
 static size_t npages_basemem;	// Amount of base memory (in pages)
+#ifdef JOS_PAE
+static size_t npages_pcihole;	// Start of the PCI hole below 4GB (in pages)
+#endif
 
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+
+#ifdef JOS_PAE
+// Each address space has 4 contiguous page directories (see inc/mmu.h).
+#define PGDIR_ORDER	2
+
+static pde_t kern_pdpt[NPDPENTRIES] __attribute__((__aligned__(32)));
+
+// PTE_NX if the CPU supports no-execute pages, 0 otherwise.
+static pte_t pte_nx;
+#else
+#define PGDIR_ORDER	0
+#define pte_nx		0
+#endif
+
+// PTE_G if the CPU supports global pages, 0 otherwise.  The kernel
+// mappings above UTOP that are the same in every address space are
+// global, so they stay in the TLB when lcr3 switches address spaces.
+static pte_t pte_g;
+
+// Physical memory zones.  ZONE_NORMAL is mapped at KERNBASE; ZONE_HIGH,
+// the pages from HIGHMEM up, is only reachable through kmap and is
+// handed out to callers that pass ALLOC_HIGHMEM.  HIGHMEM is aligned far
+// beyond the largest block order, so buddies never straddle the zones.
+enum {
+	ZONE_NORMAL,
+	ZONE_HIGH,
+	NZONES
+};
+
+#define page_zone(pp)	(page_is_high(pp) ? ZONE_HIGH : ZONE_NORMAL)
+
+// Buddy allocator free lists, one per zone and block order.
+// A free block of 2^order pages is represented by its first page,
+// which has PP_FREE set and pp_order == order.
+struct FreeArea {
+	struct PageInfo *fa_head;	// Doubly linked via pp_link/pp_prev
+	size_t fa_nfree;		// Number of free blocks on the list
+};
+
+static struct FreeArea page_free_area[NZONES][PAGE_MAX_ORDER + 1];
+static struct spinlock page_free_lock;	// Protects page_free_area
+// Protects every counter in meminfo, so that meminfo_read gets a
+// consistent copy.  APs update the free and total page counts while
+// they set up pages[] without the kernel lock.
+static struct spinlock meminfo_lock;
+
+// Per-CPU page magazines.
+// Each CPU keeps a small stack of free pages per zone in front of the buddy
+// allocator, so the common page_alloc/page_free pair never touches the
+// shared free lists.  Magazines are refilled from, and drained to, the
+// order-0 free list in batches of PAGE_MAG_BATCH pages under
+// page_free_lock.
+#define PAGE_MAG_SIZE	32		// Pages cached per CPU
+#define PAGE_MAG_BATCH	(PAGE_MAG_SIZE / 2)
+
+struct PageMag {
+	int pm_count;				// Number of cached pages
+	struct PageInfo *pm_pages[PAGE_MAG_SIZE];
+} __attribute__((__aligned__(64)));	// One cache line per CPU at least
+
+static struct PageMag page_mags[NCPU][NZONES];
+
+// Pre-zeroed page pool.
+// Idle CPUs (sched_halt) and the clock tick zero free ZONE_NORMAL pages
+// ahead of time and park them here, linked through pp_link, so that most
+// page_alloc(ALLOC_ZERO) calls can skip the memset.  Protected by
+// page_free_lock; page_zero_count includes pages being zeroed.
+#define PAGE_ZERO_MAX	256		// Most pages kept pre-zeroed
+#define PAGE_ZERO_LOW	32		// Clock tick tops up below this
+#define PAGE_ZERO_BATCH	16		// Pages zeroed per idle pass
+
+static struct PageInfo *page_zero_list;
+static size_t page_zero_count;
+
+// Page coloring (CONFIG_PAGE_COLOR=1, see conf/env.mk).
+// Pages whose addresses index the same sets of the L2 cache have the
+// same color, PGNUM(pa) % page_ncolors.  ALLOC_COLOR requests are
+// served from per-color lists, linked through pp_link, which are filled
+// by taking a buddy block holding one page of each color.  Pages on
+// the lists count as free, like the magazines'.  Protected by
+// page_free_lock.  page_ncolors is 1 when coloring is off.
+#define PAGE_COLOR_MAX	256		// The lists are drained beyond this
+
+static int page_ncolors = 1;
+static int page_color_order;		// log2(page_ncolors)
+static struct PageInfo *page_color_list[NZONES][PAGE_MAX_COLORS];
+static size_t page_color_count;		// Pages on all the color lists
+
+#define page_color(pp)	((pp - pages) & (page_ncolors - 1))
+
+// Physical memory statistics.  Every counter is updated in O(1) by the
+// operation that changes it, so readers just copy the structure.
+struct MemInfo meminfo;
+
+// Deferred initialization of pages[].
+// mem_init only sets up the PageInfos of the first PAGE_INIT_EARLY
+// pages.  The rest are set up and freed PAGE_INIT_CHUNK pages at a time
+// by page_init_deferred: on the APs as they start, on idle CPUs, and by
+// page_alloc before it gives up.  The variables are protected by
+// page_free_lock.
+#define PAGE_INIT_EARLY	(64 * 1024 * 1024 / PGSIZE)
+#define PAGE_INIT_CHUNK	(1 << PAGE_MAX_ORDER)
+
+static size_t page_init_next;		// First page no CPU has claimed
+static size_t page_init_end;		// Set by page_init_high
+static size_t page_init_left;		// Pages claimed or not, still to free
+static uint64_t page_init_cycles;	// Spent in page_init and page_init_high
+static uint64_t page_init_tsc;		// When the deferred work was handed out
+static uint32_t page_init_cpus;		// CPUs that did some, as a bit mask
+
+// kmap windows: this CPU's next free slot, and the PTEs of all slots.
+static int kmap_depth[NCPU];
+static pte_t *kmap_ptes;
+// The boot-time checks take the free lists apart and count free pages,
+// so the magazines are only switched on once mem_init is done with them.
+static bool page_mags_enabled;
 
 
 // --------------------------------------------------------------
@@ -34,24 +160,45 @@ nvram_read(int r)
 static void
 i386_detect_memory(void)
 {
-	size_t npages_extmem;
+	size_t npages_extmem, npages_ext16mem;
+#ifdef JOS_PAE
+	size_t npages_4gmem;
+#endif
 
 	// Use CMOS calls to measure available base & extended memory.
-	// (CMOS calls return results in kilobytes.)
+	// (CMOS calls return results in kilobytes, except for the memory
+	// above 16MB, which is counted in 64KB units.)
 	npages_basemem = (nvram_read(NVRAM_BASELO) * 1024) / PGSIZE;
 	npages_extmem = (nvram_read(NVRAM_EXTLO) * 1024) / PGSIZE;
+	npages_ext16mem = (nvram_read(NVRAM_EXT16LO) * 64 * 1024) / PGSIZE;
 
 	// Calculate the number of physical pages available in both base
 	// and extended memory.
-	if (npages_extmem)
+	if (npages_ext16mem) {
+		npages = (16 * 1024 * 1024) / PGSIZE + npages_ext16mem;
+		npages_extmem = npages - EXTPHYSMEM / PGSIZE;
+	} else if (npages_extmem)
 		npages = (EXTPHYSMEM / PGSIZE) + npages_extmem;
 	else
 		npages = npages_basemem;
+#ifdef JOS_PAE
+	// Memory above 4GB is also counted in 64KB units, in 3 bytes.
+	// The gap between the end of memory below 4GB and 4GB is used
+	// by PCI devices and is never handed out.
+	npages_pcihole = npages;
+	npages_4gmem = nvram_read(NVRAM_EXT4GLO) | mc146818_read(NVRAM_EXT4GHI) << 16;
+	npages_4gmem *= 64 * 1024 / PGSIZE;
+	if (npages_4gmem)
+		npages = (1ULL << 32) / PGSIZE + npages_4gmem;
+#endif
+	npages_lowmem = MIN(npages, PGNUM(HIGHMEM));
 
 	cprintf("Physical memory: %uK available, base = %uK, extended = %uK\n",
 			npages * PGSIZE / 1024,
 			npages_basemem * PGSIZE / 1024,
 			npages_extmem * PGSIZE / 1024);
+	if (npages > npages_lowmem)
+		cprintf("High memory: %uK\n", (npages - npages_lowmem) * PGSIZE / 1024);
 }
 
 
@@ -60,13 +207,22 @@ i386_detect_memory(void)
 // --------------------------------------------------------------
 
 static void mem_init_mp(void);
-static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static void page_color_init(void);
+static void page_init_high(void);
+static void pgdir_init(pde_t *pgdir, pde_t *pdpt);
+static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, pte_t perm);
+static void boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, pte_t perm);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
 static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
+static void check_page_color(void);
+static void check_pgdir_share(void);
+
+// Physical memory [0, boot_mapsize) is what entry_pgdir maps at KERNBASE.
+static size_t boot_mapsize;
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -79,11 +235,12 @@ static void check_page_installed_pgdir(void);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the page allocator has been set up.
 static void *
 boot_alloc(uint32_t n)
 {
 	static char *nextfree;	// virtual address of next byte of free memory
+	extern pde_t entry_pgdir[];
 	char *result;
 
 	// Initialize nextfree if this is the first time.
@@ -94,6 +251,20 @@ boot_alloc(uint32_t n)
 	if (!nextfree) {
 		extern char end[];
 		nextfree = ROUNDUP((char *) end, PGSIZE);
+		boot_mapsize = ENTRY_MAPSIZE;
+	}
+
+	// entry_pgdir maps only the first ENTRY_MAPSIZE bytes, which
+	// 'pages' outgrows on machines with much memory.  Keep at least
+	// PTSIZE mapped beyond nextfree, so page_init has some extended
+	// memory to hand out before kern_pgdir is loaded, extending the
+	// mapping a superpage at a time.
+	if ((uint32_t) (nextfree - KERNBASE) + ROUNDUP(n, PGSIZE) > npages_lowmem * PGSIZE)
+		panic("boot_alloc: out of memory");
+	while ((uint32_t) (nextfree - KERNBASE) + ROUNDUP(n, PGSIZE) + PTSIZE > boot_mapsize
+	       && boot_mapsize < npages_lowmem * PGSIZE) {
+		entry_pgdir[PDX(KERNBASE + boot_mapsize)] = boot_mapsize | PTE_PS | PTE_P | PTE_W;
+		boot_mapsize += PTSIZE;
 	}
 
 	// Allocate a chunk large enough to hold 'n' bytes, then update
@@ -130,8 +301,11 @@ boot_alloc(uint32_t n)
 void
 mem_init(void)
 {
-	uint32_t cr0;
+	uint32_t cr0, cpuid_edx;
 	size_t n;
+#ifdef JOS_PAE
+	uint32_t cpuid_max;
+#endif
 
 	// Find out how much memory the machine has (npages & npages_basemem).
 	i386_detect_memory();
@@ -141,17 +315,24 @@ mem_init(void)
 
 	//////////////////////////////////////////////////////////////////////
 	// create initial page directory.
-	kern_pgdir = (pde_t *) boot_alloc(PGSIZE);
-	memset(kern_pgdir, 0, PGSIZE);
-
-	//////////////////////////////////////////////////////////////////////
-	// Recursively insert PD in itself as a page table, to form
-	// a virtual page table at virtual address UVPT.
-	// (For now, you don't have understand the greater purpose of the
-	// following line.)
+#ifdef JOS_PAGE_COLOR
+	page_color_init();
+#endif
+#ifdef JOS_PAE
+	// Use no-execute pages if the CPU has them.
+	cpuid(0x80000000, &cpuid_max, NULL, NULL, NULL);
+	if (cpuid_max >= 0x80000001) {
+		cpuid(0x80000001, NULL, NULL, NULL, &cpuid_edx);
+		if (cpuid_edx & (1 << 20))
+			pte_nx = PTE_NX;
+	}
+#endif
+	cpuid(1, NULL, NULL, NULL, &cpuid_edx);
+	if (cpuid_edx & (1 << 13))
+		pte_g = PTE_G;
 
-	// Permissions: kernel R, user R
-	kern_pgdir[PDX(UVPT)] = PADDR(kern_pgdir) | PTE_U | PTE_P;
+	kern_pgdir = (pde_t *) boot_alloc(NPDENTRIES * sizeof(pde_t));
+	memset(kern_pgdir, 0, NPDENTRIES * sizeof(pde_t));
 
 	//////////////////////////////////////////////////////////////////////
 	// Allocate an array of npages 'struct PageInfo's and store it in 'pages'.
@@ -175,6 +356,16 @@ mem_init(void)
 	// particular, we can now map memory using boot_map_region
 	// or page_insert
 	page_init();
+
+	//////////////////////////////////////////////////////////////////////
+	// Recursively insert PD in itself as a page table, to form
+	// a virtual page table at virtual address UVPT.
+#ifdef JOS_PAE
+	pgdir_init(kern_pgdir, kern_pdpt);
+#else
+	pgdir_init(kern_pgdir, NULL);
+#endif
+
 	check_page_free_list(1);
 
 	check_page_alloc();
@@ -191,7 +382,9 @@ mem_init(void)
 	//      (ie. perm = PTE_U | PTE_P)
 	//    - pages itself -- kernel RW, user NONE
 	// Your code goes here:
-	boot_map_region(kern_pgdir, UPAGES, ROUNDUP(npages*sizeof(struct PageInfo), PGSIZE), PADDR(pages), PTE_U); //ref to 北大报告。
+	// With much high memory 'pages' is larger than PTSIZE; user space
+	// then only sees the entries that fit.
+	boot_map_region(kern_pgdir, UPAGES, MIN(ROUNDUP(npages*sizeof(struct PageInfo), PGSIZE), PTSIZE), PADDR(pages), PTE_U | pte_nx | pte_g); //ref to 北大报告。
 
 	//////////////////////////////////////////////////////////////////////
 	// Map the 'envs' array read-only by the user at linear address UENVS
@@ -200,8 +393,7 @@ mem_init(void)
 	//    - the new image at UENVS  -- kernel R, user R
 	//    - envs itself -- kernel RW, user NONE
 	// LAB 3: Your code here.
-	boot_map_region(kern_pgdir, (uintptr_t)envs, ROUNDUP(NENV*sizeof(struct Env), PGSIZE), PADDR(envs), PTE_W);
-	boot_map_region(kern_pgdir, UENVS, UPAGES-UENVS, PADDR(envs), PTE_U);
+	boot_map_region(kern_pgdir, UENVS, UPAGES-UENVS, PADDR(envs), PTE_U | pte_nx | pte_g);
 
 
 	//////////////////////////////////////////////////////////////////////
@@ -215,7 +407,7 @@ mem_init(void)
 	//       overwrite memory.  Known as a "guard page".
 	//     Permissions: kernel RW, user NONE
 	// Your code goes here:
-	boot_map_region(kern_pgdir, KSTACKTOP-KSTKSIZE, KSTKSIZE, PADDR(bootstack), PTE_W); //ref to 北大报告。
+	boot_map_region(kern_pgdir, KSTACKTOP-KSTKSIZE, KSTKSIZE, PADDR(bootstack), PTE_W | pte_nx | pte_g); //ref to 北大报告。
 
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE.
@@ -226,7 +418,11 @@ mem_init(void)
 	// Permissions: kernel RW, user NONE
 	// Your code goes here:
 
-	boot_map_region(kern_pgdir, KERNBASE, 0x10000000, 0, PTE_W); //ref to 北大报告。
+	// Physical memory from HIGHMEM up is not mapped here; see kmap.
+	// Superpages save the page tables and most of the TLB misses of
+	// the kernel's own accesses to memory.
+	static_assert(KERNBASE % PTSIZE == 0 && HIGHMEM % PTSIZE == 0);
+	boot_map_region_large(kern_pgdir, KERNBASE, HIGHMEM, 0, PTE_W | pte_g);
 
 	// Initialize the SMP-related parts of the memory map
 	mem_init_mp();
@@ -241,7 +437,11 @@ mem_init(void)
 	//
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
-	lcr3(PADDR(kern_pgdir));
+	mem_init_percpu();
+	pgdir_load(kern_pgdir);
+
+	// All of physical memory is reachable now; free the rest of it.
+	page_init_high();
 
 	check_page_free_list(0);
 
@@ -254,6 +454,12 @@ mem_init(void)
 
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+
+	// The checks are done taking the free lists apart; from now on
+	// page_alloc and page_free go through the per-CPU magazines.
+	page_mags_enabled = 1;
+	check_page_color();
+	check_pgdir_share();
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -282,21 +488,134 @@ mem_init_mp(void)
 	for (i = 0; i < NCPU; i++)
 	{
 		boot_map_region(kern_pgdir, KSTACKTOP-(i*(KSTKSIZE+KSTKGAP))-KSTKSIZE,
-						KSTKSIZE, PADDR(percpu_kstacks[i]), PTE_W);
+						KSTKSIZE, PADDR(percpu_kstacks[i]), PTE_W | pte_nx | pte_g);
+	}
+
+	// The kmap windows share the stacks' page table, so every
+	// environment sees the same slots.
+	static_assert(KMAPBASE % PTSIZE == 0);
+	static_assert(KMAPBASE + NCPU * KMAP_NSLOTS * PGSIZE
+		      <= KSTACKTOP - NCPU * (KSTKSIZE + KSTKGAP));
+	kmap_ptes = pgdir_walk(kern_pgdir, (void *) KMAPBASE, 1);
+	assert(kmap_ptes);
+}
+
+//
+// Per-CPU part of the MMU setup, run by every CPU before it loads
+// kern_pgdir.
+//
+void
+mem_init_percpu(void)
+{
+#ifdef JOS_PAE
+	// PTE_NX is a reserved bit unless EFER_NXE is set.
+	if (pte_nx)
+		wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
+#endif
+	if (pte_g)
+		lcr4(rcr4() | CR4_PGE);
+}
+
+//
+// Switch this CPU to pgdir, and note it for TLB shootdowns.
+//
+void
+pgdir_load(pde_t *pgdir)
+{
+	thiscpu->cpu_pgdir = pgdir;
+	lcr3(pgdir_cr3(pgdir));
+}
+
+//
+// Set up the parts of a new page directory that depend on where it is:
+// the UVPT self-mapping and, with PAE, the page directory pointer table.
+//
+static void
+pgdir_init(pde_t *pgdir, pde_t *pdpt)
+{
+	int i;
+
+	// The page directory is its own page table at UVPT (four of them
+	// with PAE, one per page).  Permissions: kernel R, user R
+	for (i = 0; i < NPDENTRIES / NPTENTRIES; i++)
+		pgdir[PDX(UVPT) + i] = PADDR(pgdir + i * NPTENTRIES) | PTE_U | PTE_P;
+
+#ifdef JOS_PAE
+	// Only the present bit may be set in PDPT entries.
+	for (i = 0; i < NPDPENTRIES; i++)
+		pdpt[i] = PADDR(pgdir + i * NPTENTRIES) | PTE_P;
+	pa2page(PADDR(pgdir))->pp_pdpt = pdpt;
+#endif
+}
+
+//
+// Allocate a page directory for a new address space, with nothing
+// mapped but UVPT, and with pp_ref set to 1.
+// Returns NULL if out of memory.
+//
+pde_t *
+pgdir_alloc(void)
+{
+	struct PageInfo *pp;
+	pde_t *pdpt = NULL;
+
+#ifdef JOS_PAE
+	if (!(pdpt = kmalloc(NPDPENTRIES * sizeof(pde_t))))
+		return NULL;
+	if (!(pp = page_alloc_npages(PGDIR_ORDER, ALLOC_ZERO))) {
+		kfree(pdpt);
+		return NULL;
+	}
+#else
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return NULL;
+#endif
+	pp->pp_ref++;
+	pgdir_init(page2kva(pp), pdpt);
+	return page2kva(pp);
+}
+
+//
+// Drop a reference to a page directory from pgdir_alloc, freeing it
+// when there are no more.
+//
+void
+pgdir_free(pde_t *pgdir)
+{
+	struct PageInfo *pp = pa2page(PADDR(pgdir));
+
+#ifdef JOS_PAE
+	if (--pp->pp_ref == 0) {
+		kfree(pp->pp_pdpt);
+		pp->pp_pdpt = NULL;
+		page_free_npages(pp, PGDIR_ORDER);
 	}
+#else
+	page_decref(pp);
+#endif
 }
 
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct PageInfo' entry per physical page.
-// Pages are reference counted, and free pages are kept on a linked list.
+// Pages are reference counted, and free pages are kept by a buddy
+// allocator in power-of-two sized, naturally aligned blocks.
 // --------------------------------------------------------------
 
+static void page_free_range(size_t start, size_t end);
+static void page_init_range(size_t start, size_t end);
+
 //
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory.
+//
+// Only the pages mapped by entry_pgdir, the first boot_mapsize bytes
+// of physical memory, are handed to the allocator here: everything that
+// is allocated before kern_pgdir is loaded must be reachable through
+// KADDR.  mem_init frees the rest with page_init_high once kern_pgdir
+// maps all of physical memory.
 //
 
 void mark_page_as_used(physaddr_t va_start, physaddr_t va_end)
@@ -332,12 +651,16 @@ page_init(void)
 	// Change the code to reflect this.
 	// NB: DO NOT actually touch the physical memory corresponding to
 	// free pages!
-	size_t i;
-	for (i = 0; i < npages; i++) {
-		pages[i].pp_ref = 0;
-	}
+	uint64_t tsc = read_tsc();
+
+	// Only the first pages are set up now, see page_init_deferred.
+	page_init_next = ROUNDUP(MAX((size_t) PAGE_INIT_EARLY, PGNUM(boot_mapsize)),
+				 PAGE_INIT_CHUNK);
+	page_init_next = MIN(page_init_next, npages);
+	page_init_range(0, page_init_next);
 	// mark if memory is out.
-	page_free_list =  NULL;
+	memset(page_free_area, 0, sizeof(page_free_area));
+	spin_initlock(&page_free_lock);
 	mark_page_as_used(0,PGSIZE);
 	mark_page_as_used(IOPHYSMEM, EXTPHYSMEM);
 	uintptr_t KERN_PHYSICAL_BASE = 0x10000;
@@ -348,13 +671,563 @@ page_init(void)
 	mark_page_as_used(MPENTRY_PADDR, ROUNDUP(MPENTRY_PADDR+mpentry_end-mpentry_start, PGSIZE));
 	//mark_page_as_used(MPENTRY_PADDR, MPENTRY_PADDR+PGSIZE);
 
-	for (i = 0; i < npages; i++) {
-		if(!pages[i].pp_ref){
-			//link free_list to pages.pp_link and update page_free_list.
-			pages[i].pp_link = page_free_list;
-			page_free_list = &pages[i];
+	page_free_range(0, MIN(npages, PGNUM(boot_mapsize)));
+	page_init_cycles = read_tsc() - tsc;
+}
+
+//
+// Set up the PageInfos of pages [start, end) as unused, except for the
+// pages that must never be allocated above the kernel's own.
+//
+static void
+page_init_range(size_t start, size_t end)
+{
+	memset(&pages[start], 0, (end - start) * sizeof(struct PageInfo));
+#ifdef JOS_PAE
+	// The PCI hole below 4GB.
+	size_t i;
+	for (i = MAX(start, npages_pcihole); i < MIN(end, (size_t) ((1ULL << 32) / PGSIZE)); i++)
+		pages[i].pp_ref = 1;
+#endif
+}
+
+//
+// Give the pages above what entry_pgdir maps to the allocator, as far
+// as page_init set them up, and leave the rest to page_init_deferred.
+// Must only be called once kern_pgdir is loaded.
+//
+static void
+page_init_high(void)
+{
+	uint64_t tsc = read_tsc();
+
+	page_free_range(MIN(npages, PGNUM(boot_mapsize)), page_init_next);
+	// Boot-time allocations don't count towards the low-water mark.
+	meminfo.mi_free_min = meminfo.mi_free;
+
+	page_init_cycles += read_tsc() - tsc;
+	cprintf("pages[]: %u of %u pages set up at boot in %u kcycles\n",
+		page_init_next, npages, (uint32_t) (page_init_cycles / 1000));
+
+	spin_lock(&page_free_lock);
+	page_init_tsc = read_tsc();
+	page_init_left = npages - page_init_next;
+	page_init_end = npages;
+	spin_unlock(&page_free_lock);
+}
+
+//
+// Set up and free the next PAGE_INIT_CHUNK pages that mem_init left
+// for later.  Several CPUs may do this at the same time.
+// Returns 1 if it did, 0 if there is nothing left to do.
+//
+int
+page_init_deferred(void)
+{
+	size_t start, end, n;
+	int cpu, ncpus;
+
+	spin_lock(&page_free_lock);
+	start = end = page_init_next;
+	if (start < page_init_end)
+		end = page_init_next = MIN(start + PAGE_INIT_CHUNK, page_init_end);
+	spin_unlock(&page_free_lock);
+	if (start == end)
+		return 0;
+
+	page_init_range(start, end);
+	page_free_range(start, end);
+
+	spin_lock(&page_free_lock);
+	page_init_cpus |= 1 << cpunum();
+	page_init_left -= end - start;
+	n = page_init_left;
+	spin_unlock(&page_free_lock);
+	if (n == 0) {
+		for (cpu = ncpus = 0; cpu < NCPU; cpu++)
+			ncpus += (page_init_cpus >> cpu) & 1;
+		cprintf("pages[]: the rest set up in %u kcycles on %d CPUs\n",
+			(uint32_t) ((read_tsc() - page_init_tsc) / 1000), ncpus);
+	}
+	return 1;
+}
+
+//
+// Buddy allocator internals.  All of these must be called with
+// page_free_lock held (or before other CPUs are running).
+//
+
+static void
+free_area_add(struct PageInfo *pp, int order)
+{
+	struct FreeArea *fa = &page_free_area[page_zone(pp)][order];
+
+	pp->pp_flags |= PP_FREE;
+	pp->pp_order = order;
+	pp->pp_prev = NULL;
+	pp->pp_link = fa->fa_head;
+	if (fa->fa_head)
+		fa->fa_head->pp_prev = pp;
+	fa->fa_head = pp;
+	fa->fa_nfree++;
+}
+
+static void
+free_area_del(struct PageInfo *pp, int order)
+{
+	struct FreeArea *fa = &page_free_area[page_zone(pp)][order];
+
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		fa->fa_head = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	// The union may still hold page table or reverse map fields.
+	pp->pp_link = pp->pp_prev = NULL;
+	pp->pp_flags &= ~PP_FREE;
+	fa->fa_nfree--;
+}
+
+//
+// Remove a free block of 2^order pages from the zone's free lists,
+// splitting a larger block if needed.  Returns NULL if no block is
+// large enough.
+//
+static struct PageInfo *
+buddy_alloc(int zone, int order)
+{
+	struct FreeArea *fa = page_free_area[zone];
+	struct PageInfo *pp;
+	int o;
+
+	for (o = order; o <= PAGE_MAX_ORDER; o++)
+		if (fa[o].fa_head)
+			break;
+	if (o > PAGE_MAX_ORDER)
+		return NULL;
+
+	pp = fa[o].fa_head;
+	free_area_del(pp, o);
+	// Keep the low half and put the high half back, so that the
+	// allocator tends to hand out low physical addresses first.
+	while (o > order) {
+		o--;
+		free_area_add(pp + (1 << o), o);
+	}
+	return pp;
+}
+
+//
+// Return a block of 2^order pages to the free lists, merging it with
+// its buddy for as long as the buddy is free and of the same order.
+//
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+	size_t idx = pp - pages;
+	struct PageInfo *buddy;
+
+	assert((idx & ((1 << order) - 1)) == 0);
+	while (order < PAGE_MAX_ORDER) {
+		size_t bidx = idx ^ (1 << order);
+		if (bidx + (1 << order) > npages)
+			break;
+		buddy = &pages[bidx];
+		if (!(buddy->pp_flags & PP_FREE) || buddy->pp_order != order)
+			break;
+		free_area_del(buddy, order);
+		idx &= ~(1 << order);
+		order++;
+	}
+	free_area_add(&pages[idx], order);
+}
+
+//
+// Account for n pages leaving or joining the free memory.
+//
+static void
+meminfo_alloc(size_t n)
+{
+	spin_lock(&meminfo_lock);
+	meminfo.mi_free -= n;
+	if (meminfo.mi_free < meminfo.mi_free_min)
+		meminfo.mi_free_min = meminfo.mi_free;
+	spin_unlock(&meminfo_lock);
+}
+
+static void
+meminfo_free(size_t n)
+{
+	spin_lock(&meminfo_lock);
+	meminfo.mi_free += n;
+	spin_unlock(&meminfo_lock);
+}
+
+//
+// Add n, which may be negative, to the meminfo counter *counter, and
+// raise its high-water mark *max to match if max is not NULL.
+//
+void
+meminfo_add(uint32_t *counter, int n, uint32_t *max)
+{
+	spin_lock(&meminfo_lock);
+	*counter += n;
+	if (max && *counter > *max)
+		*max = *counter;
+	spin_unlock(&meminfo_lock);
+}
+
+//
+// Copy the memory statistics to 'info'.  If pgdir is not NULL,
+// mi_env_resident is set to the number of pages mapped in it.
+//
+void
+meminfo_read(struct MemInfo *info, pde_t *pgdir)
+{
+	spin_lock(&meminfo_lock);
+	*info = meminfo;
+	spin_unlock(&meminfo_lock);
+	info->mi_env_resident = pgdir ? pgdir_nmapped(pgdir) : 0;
+}
+
+//
+// Free every page in [start, end) whose pp_ref is zero,
+// in the largest aligned blocks possible.
+//
+static void
+page_free_range(size_t start, size_t end)
+{
+	size_t i = start, nfree = 0;
+	int order;
+
+	spin_lock(&page_free_lock);
+	while (i < end) {
+		if (pages[i].pp_ref) {
+			i++;
+			continue;
+		}
+		// Grow the block while it stays aligned, in range and free.
+		for (order = 0; order < PAGE_MAX_ORDER; order++) {
+			size_t j, n = 1 << (order + 1);
+			if ((i & (n - 1)) || i + n > end)
+				break;
+			for (j = i + (n >> 1); j < i + n; j++)
+				if (pages[j].pp_ref)
+					break;
+			if (j < i + n)
+				break;
+		}
+		buddy_free(&pages[i], order);
+		nfree += 1 << order;
+		i += 1 << order;
+	}
+	spin_unlock(&page_free_lock);
+
+	spin_lock(&meminfo_lock);
+	meminfo.mi_total += nfree;
+	meminfo.mi_free += nfree;
+	spin_unlock(&meminfo_lock);
+}
+
+//
+// Number of pages on the buddy allocator's free lists.
+//
+static size_t
+page_nfree(void)
+{
+	size_t n = 0;
+	int zone, order;
+
+	for (zone = 0; zone < NZONES; zone++)
+		for (order = 0; order <= PAGE_MAX_ORDER; order++)
+			n += page_free_area[zone][order].fa_nfree << order;
+	return n;
+}
+
+//
+// Take a page from this CPU's magazine for 'zone', refilling it with up
+// to PAGE_MAG_BATCH order-0 pages from the buddy allocator when it runs
+// dry.  Returns NULL only if both the magazine and the zone are empty.
+// Pages cached in other CPUs' magazines are not reclaimed.
+//
+static struct PageInfo *
+page_mag_alloc(int zone)
+{
+	struct PageMag *pm = &page_mags[cpunum()][zone];
+	struct PageInfo *pp;
+
+	if (pm->pm_count == 0) {
+		spin_lock(&page_free_lock);
+		while (pm->pm_count < PAGE_MAG_BATCH && (pp = buddy_alloc(zone, 0)))
+			pm->pm_pages[pm->pm_count++] = pp;
+		spin_unlock(&page_free_lock);
+		if (pm->pm_count == 0)
+			return NULL;
+	}
+	return pm->pm_pages[--pm->pm_count];
+}
+
+//
+// Put a page into this CPU's magazine for its zone, first draining
+// PAGE_MAG_BATCH pages back to the buddy allocator if the magazine is full.
+//
+static void
+page_mag_free(struct PageInfo *pp)
+{
+	struct PageMag *pm = &page_mags[cpunum()][page_zone(pp)];
+
+	if (pm->pm_count == PAGE_MAG_SIZE) {
+		spin_lock(&page_free_lock);
+		while (pm->pm_count > PAGE_MAG_SIZE - PAGE_MAG_BATCH)
+			buddy_free(pm->pm_pages[--pm->pm_count], 0);
+		spin_unlock(&page_free_lock);
+	}
+	pm->pm_pages[pm->pm_count++] = pp;
+}
+
+//
+// Work out the number of page colors from the L2 cache geometry that
+// cpuid reports.  Coloring stays off if the CPU doesn't tell.
+//
+static void
+page_color_init(void)
+{
+	// L2 associativity, by its encoding in cpuid leaf 0x80000006.
+	static const uint8_t l2_ways[16] = {
+		[0x1] = 1, [0x2] = 2, [0x4] = 4, [0x6] = 8, [0x8] = 16,
+		[0xa] = 32, [0xc] = 64,
+	};
+	uint32_t cpuid_max, ecx, size, ways;
+
+	cpuid(0x80000000, &cpuid_max, NULL, NULL, NULL);
+	if (cpuid_max < 0x80000006)
+		return;
+	cpuid(0x80000006, NULL, NULL, &ecx, NULL);
+	size = (ecx >> 16) * 1024;
+	ways = l2_ways[(ecx >> 12) & 0xf];
+	if (!size || !ways)
+		return;
+	while (page_ncolors < PAGE_MAX_COLORS
+	       && page_ncolors * 2 * ways * PGSIZE <= size) {
+		page_ncolors *= 2;
+		page_color_order++;
+	}
+	cprintf("page coloring: %d colors (%dK %d-way L2)\n",
+		page_ncolors, size / 1024, ways);
+}
+
+//
+// Give every page on the color lists back to the buddy allocator.
+//
+static void
+page_color_drain(void)
+{
+	struct PageInfo *pp;
+	int zone, color;
+
+	for (zone = 0; zone < NZONES; zone++)
+		for (color = 0; color < page_ncolors; color++)
+			while ((pp = page_color_list[zone][color])) {
+				page_color_list[zone][color] = pp->pp_link;
+				pp->pp_link = NULL;
+				buddy_free(pp, 0);
+			}
+	page_color_count = 0;
+}
+
+//
+// Take a page of the given color from the zone's color list, refilling
+// the lists from the buddy allocator if it is empty and 'refill' is set.
+// Returns NULL if there is no such page.
+// Must be called with page_free_lock held.
+//
+static struct PageInfo *
+page_color_take(int zone, int color, bool refill)
+{
+	struct PageInfo **list = &page_color_list[zone][color];
+	struct PageInfo *pp;
+	int i;
+
+	if (!*list && refill) {
+		// Requests skewed to a few colors leave the others piling
+		// up; hand them back rather than hoard them.
+		if (page_color_count + page_ncolors > PAGE_COLOR_MAX)
+			page_color_drain();
+		if ((pp = buddy_alloc(zone, page_color_order))) {
+			for (i = 0; i < page_ncolors; i++) {
+				pp[i].pp_link = page_color_list[zone][page_color(&pp[i])];
+				page_color_list[zone][page_color(&pp[i])] = &pp[i];
+			}
+			page_color_count += page_ncolors;
 		}
 	}
+	if (!(pp = *list))
+		return NULL;
+	*list = pp->pp_link;
+	pp->pp_link = NULL;
+	page_color_count--;
+	return pp;
+}
+
+//
+// Serve an ALLOC_COLOR request, or with 'any' set, take a page of any
+// color that is sitting on the lists.  Returns NULL if there is none.
+//
+static struct PageInfo *
+page_color_alloc(int alloc_flags, bool any)
+{
+	int color = (alloc_flags >> ALLOC_COLOR_SHIFT) & (page_ncolors - 1);
+	int zone, i;
+	struct PageInfo *pp = NULL;
+
+	spin_lock(&page_free_lock);
+	for (zone = (alloc_flags & ALLOC_HIGHMEM) ? ZONE_HIGH : ZONE_NORMAL;
+	     !pp && zone >= ZONE_NORMAL; zone--)
+		for (i = 0; !pp && i < (any ? page_ncolors : 1); i++)
+			pp = page_color_take(zone, (color + i) & (page_ncolors - 1), !any);
+	spin_unlock(&page_free_lock);
+	return pp;
+}
+
+//
+// Pop a page off the pre-zeroed pool, or return NULL if it is empty.
+//
+static struct PageInfo *
+page_zero_pop(void)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&page_free_lock);
+	if ((pp = page_zero_list)) {
+		page_zero_list = pp->pp_link;
+		pp->pp_link = NULL;
+		page_zero_count--;
+		meminfo_add(&meminfo.mi_zeroed, -1, NULL);
+	}
+	spin_unlock(&page_free_lock);
+	return pp;
+}
+
+//
+// Zero up to n free pages and move them to the pre-zeroed pool,
+// stopping early if the pool is full or no free page is left.
+// The memset runs without page_free_lock held.
+// Returns the number of pages added.
+//
+static int
+page_zero_fill(int n)
+{
+	struct PageInfo *pp;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		spin_lock(&page_free_lock);
+		pp = NULL;
+		if (page_zero_count < PAGE_ZERO_MAX && (pp = buddy_alloc(ZONE_NORMAL, 0)))
+			page_zero_count++;
+		spin_unlock(&page_free_lock);
+		if (!pp)
+			break;
+
+		memset(page2kva(pp), 0, PGSIZE);
+
+		spin_lock(&page_free_lock);
+		pp->pp_link = page_zero_list;
+		page_zero_list = pp;
+		meminfo_add(&meminfo.mi_zeroed, 1, NULL);
+		meminfo_add(&meminfo.mi_zero_filled, 1, NULL);
+		spin_unlock(&page_free_lock);
+	}
+	return i;
+}
+
+//
+// Called by sched_halt before an idle CPU halts: set up some more of
+// pages[] if mem_init left any, or else zero a batch of pages.
+//
+void
+page_zero_idle(void)
+{
+	if (page_mags_enabled && !page_init_deferred())
+		page_zero_fill(PAGE_ZERO_BATCH);
+}
+
+//
+// Called on every clock tick: keep a minimum number of pages zeroed even
+// when no CPU ever goes idle, one page per tick.
+//
+void
+page_zero_tick(void)
+{
+	if (page_mags_enabled && page_zero_count < PAGE_ZERO_LOW)
+		page_zero_fill(1);
+}
+
+//
+// Zero a page that may lie in high memory.
+//
+static void
+page_zero(struct PageInfo *pp)
+{
+	void *kva = kmap(pp);
+
+	memset(kva, 0, PGSIZE);
+	kunmap(kva);
+}
+
+//
+// Allocates 2^order physically contiguous pages, aligned to their size.
+// If (alloc_flags & ALLOC_ZERO), fills the whole block with '\0' bytes.
+// If (alloc_flags & ALLOC_HIGHMEM), the block is taken from high memory
+// when there is any left.
+// Does NOT increment the reference count of the first page - the caller
+// must do this if necessary.  The block must be released with
+// page_free_npages using the same order.
+//
+// Returns NULL if there is no free block that large.
+//
+struct PageInfo *
+page_alloc_npages(int order, int alloc_flags)
+{
+	struct PageInfo *pp = NULL;
+	int i;
+
+	if (order < 0 || order > PAGE_MAX_ORDER)
+		return NULL;
+
+	do {
+		spin_lock(&page_free_lock);
+		if (alloc_flags & ALLOC_HIGHMEM)
+			pp = buddy_alloc(ZONE_HIGH, order);
+		if (!pp)
+			pp = buddy_alloc(ZONE_NORMAL, order);
+		spin_unlock(&page_free_lock);
+	} while (!pp && page_init_deferred());
+	if (!pp)
+		return NULL;
+	meminfo_alloc(1 << order);
+
+	if ((alloc_flags & ALLOC_ZERO) && !page_is_high(pp))
+		memset(page2kva(pp), 0, PGSIZE << order);
+	else if (alloc_flags & ALLOC_ZERO)
+		for (i = 0; i < (1 << order); i++)
+			page_zero(pp + i);
+	return pp;
+}
+
+//
+// Return a block allocated with page_alloc_npages(order, ...).
+//
+void
+page_free_npages(struct PageInfo *pp, int order)
+{
+	assert(!pp->pp_ref);
+	assert(order >= 0 && order <= PAGE_MAX_ORDER);
+	meminfo_free(1 << order);
+	spin_lock(&page_free_lock);
+	buddy_free(pp, order);
+	spin_unlock(&page_free_lock);
 }
 
 //
@@ -363,22 +1236,57 @@ page_init(void)
 // count of the page - the caller must do these if necessary (either explicitly
 // or via page_insert).
 //
+// If (alloc_flags & ALLOC_HIGHMEM), the page may come from high memory,
+// and is taken from there first; the kernel must use kmap to access it.
+// Pages for user mappings should be allocated this way, to leave the
+// memory mapped at KERNBASE to the kernel.
+//
+// If (alloc_flags & ALLOC_COLOR) and page coloring is on, the page is
+// of the color given by alloc_color if there is one.
+//
 // Returns NULL if out of free memory.
 //
 // Hint: use page2kva and memset
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
-	struct PageInfo * ret = page_free_list;
-	if(!ret)
-		// out of memory.
+	struct PageInfo *ret;
+
+	if (!page_mags_enabled)
+		return page_alloc_npages(0, alloc_flags);
+
+	do {
+		ret = NULL;
+		if ((alloc_flags & ALLOC_COLOR) && page_ncolors > 1)
+			ret = page_color_alloc(alloc_flags, 0);
+		if (!ret && (alloc_flags & ALLOC_HIGHMEM))
+			ret = page_mag_alloc(ZONE_HIGH);
+
+		// Zeroed requests try the pre-zeroed pool next.
+		if (!ret && (alloc_flags & ALLOC_ZERO) && (ret = page_zero_pop())) {
+			meminfo_alloc(1);
+			meminfo_add(&meminfo.mi_zero_hits, 1, NULL);
+			return ret;
+		}
+
+		if (!ret)
+			ret = page_mag_alloc(ZONE_NORMAL);
+		// Pre-zeroed pages are still free memory, and so are pages
+		// of other colors; use them as a last resort.
+		if (!ret)
+			ret = page_zero_pop();
+		if (!ret && page_ncolors > 1)
+			ret = page_color_alloc(alloc_flags, 1);
+		// out of memory, unless there are pages left to set up.
+	} while (!ret && page_init_deferred());
+	if (!ret)
 		return NULL;
+	meminfo_alloc(1);
 
-	page_free_list = ret->pp_link;
-	// Fill this function in
 	if ((alloc_flags & ALLOC_ZERO) == ALLOC_ZERO)
 	{// ALLOC_ZERO 这货就是0x01
-		memset(page2kva(ret),0,PGSIZE);
+		page_zero(ret);
+		meminfo_add(&meminfo.mi_zero_misses, 1, NULL);
 	}
 	return ret;
 }
@@ -391,9 +1299,19 @@ void
 page_free(struct PageInfo *pp)
 {
 	assert(!pp->pp_ref);
-	// Fill this function in
-	pp->pp_link = page_free_list;
-	page_free_list = pp;
+	if (pp->pp_flags & PP_PGTABLE) {
+		pp->pp_flags &= ~PP_PGTABLE;
+		meminfo_add(&meminfo.mi_pgtables, -1, NULL);
+	}
+	if (pp->pp_flags & PP_KSM)
+		ksm_page_release(pp);
+	// The union may still hold page table or reverse map fields.
+	pp->pp_link = pp->pp_prev = NULL;
+	if (page_mags_enabled) {
+		meminfo_free(1);
+		page_mag_free(pp);
+	} else
+		page_free_npages(pp, 0);
 }
 
 //
@@ -407,6 +1325,50 @@ page_decref(struct PageInfo* pp)
 		page_free(pp);
 }
 
+//
+// Map a page into the kernel's address space and return its address.
+// Pages below HIGHMEM are simply at page2kva; a high memory page is
+// mapped into the next of this CPU's KMAP_NSLOTS window slots, until
+// the matching kunmap.  kmaps nest and must be undone in LIFO order,
+// and the kernel must not give up the CPU while holding one.
+//
+void *
+kmap(struct PageInfo *pp)
+{
+	int cpu = cpunum(), slot;
+	void *va;
+
+	if (!page_is_high(pp))
+		return page2kva(pp);
+
+	if (kmap_depth[cpu] == KMAP_NSLOTS)
+		panic("kmap: out of slots on CPU %d", cpu);
+	slot = cpu * KMAP_NSLOTS + kmap_depth[cpu]++;
+	va = (void *) (KMAPBASE + slot * PGSIZE);
+	kmap_ptes[slot] = page2pa(pp) | PTE_P | PTE_W | pte_nx;
+	invlpg(va);
+	return va;
+}
+
+//
+// Undo the most recent kmap on this CPU.  Does nothing for an
+// address that kmap returned without using a slot.
+//
+void
+kunmap(void *kva)
+{
+	int cpu = cpunum(), slot;
+
+	if ((uintptr_t) kva < KMAPBASE
+	    || (uintptr_t) kva >= KMAPBASE + NCPU * KMAP_NSLOTS * PGSIZE)
+		return;
+	slot = PGNUM((uintptr_t) kva - KMAPBASE);
+	assert(kmap_depth[cpu] > 0 && slot == cpu * KMAP_NSLOTS + kmap_depth[cpu] - 1);
+	kmap_ptes[slot] = 0;
+	invlpg(kva);
+	kmap_depth[cpu]--;
+}
+
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
 // a pointer to the page table entry (PTE) for linear address 'va'.
 // This requires walking the two-level page table structure.
@@ -419,6 +1381,15 @@ page_decref(struct PageInfo* pp)
 //	the page is cleared,
 //	and pgdir_walk returns a pointer into the new page table page.
 //
+// A superpage (PTE_PS) PDE has no page table below it; pgdir_walk then
+// returns a pointer to the PDE itself, which is what maps 'va'.  Only
+// kernel mappings above UTOP are superpages.
+//
+// With create set, a page table that pgdir shares with other address
+// spaces is first replaced by a private copy (see pgdir_share_pt), as
+// the caller is presumably about to change a PTE in it.  Otherwise the
+// returned PTE may be shared, and must only be read.
+//
 // Hint 1: you can turn a Page * into the physical address of the
 // page it refers to with page2pa() from kern/pmap.h.
 //
@@ -432,6 +1403,25 @@ page_decref(struct PageInfo* pp)
 
 #define DEBUG_PGDIR_WALK
 #undef DEBUG_PGDIR_WALK
+
+// Allocate a zeroed page table for entry pdx of pgdir, referenced once.
+// Returns NULL if out of memory.
+static struct PageInfo *
+pgtable_alloc(pde_t *pgdir, unsigned pdx)
+{
+	struct PageInfo *pt;
+
+	if (!(pt = page_alloc(ALLOC_ZERO)))
+		return NULL;
+	pt->pp_ref++;
+	pt->pp_flags |= PP_PGTABLE;
+	pt->pp_ptdir = pgdir;
+	pt->pp_ptpdx = pdx;
+	pt->pp_ptcount = 0;
+	meminfo_add(&meminfo.mi_pgtables, 1, &meminfo.mi_pgtables_max);
+	return pt;
+}
+
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
@@ -442,11 +1432,17 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 	// Fill this function in
 	// high 12 bit.
 	unsigned h12 = PDX(va);
+	// Whoever may change a PTE gets a page table of its own.
+	if (create && pgdir_pt_shared(pgdir, va)
+	    && pgdir_unshare_pt(pgdir, va) < 0)
+		return NULL;
 	pgdir += h12;
 	pde_t pde = *pgdir;
 #ifdef DEBUG_PGDIR_WALK
 	cprintf("GLOBAL: pgdir:%p, PDE is %p, %3x %3x %4x\n", pgdir, (*pgdir), PDX(*pgdir), PTX(*pgdir), (*pgdir)&0xFFF);
 #endif // DEBUG_PGDIR_WALK
+	if (PAGE_PRESENT(pde) && (pde & PTE_PS))
+		return pgdir;
 	if (PAGE_PRESENT(pde))
 	{
 		//wrong: no pa to va: pte_t * ppte = (uint32_t *)(pde);
@@ -462,16 +1458,15 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 	}
 	else if (create)
 	{
-		struct PageInfo* ppi = page_alloc(ALLOC_ZERO);
+		struct PageInfo* ppi = pgtable_alloc(pgdir_backup, h12);
 		if(!ppi) // page alloc failed.
 		{
 			return NULL;
 		}
 		//todo?: //boot_map_region(pgdir,second_page_table,PGSIZE, page2pa(ppi),PTE_W|PTE_U);
 		(*pgdir) = ((page2pa(ppi)) | PTE_P|PTE_W|PTE_U);
-		pte_t * ppte = (uint32_t *)(page2kva(ppi));
+		pte_t * ppte = (pte_t *)(page2kva(ppi));
 		ppte += PTX(va);
-		ppi->pp_ref++;
 #ifdef DEBUG_PGDIR_WALK
 		cprintf("ELSE: pgdir:%p, PDE is %p, %3x %3x %4x\n", pgdir, (*pgdir), PDX(*pgdir), PTX(*pgdir), (*pgdir)&0xFFF);
 		cprintf("ELSE: ppte:%p, PTE is %p, %3x %3x %4x\n", ppte, (*ppte), PDX(*ppte), PTX(*ppte), (*ppte)&0xFFF);
@@ -484,6 +1479,68 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 	}
 }
 
+//
+// Start iterating over the PTEs of the npages pages from va in pgdir.
+//
+void
+pt_iter_init(struct PtIter *it, pde_t *pgdir, const void *va, size_t npages)
+{
+	it->pi_pgdir = pgdir;
+	it->pi_va = (uintptr_t) ROUNDDOWN(va, PGSIZE);
+	it->pi_npages = npages;
+	it->pi_pt = NULL;
+}
+
+//
+// Return the PTE of the iterator's next page, and store the page's
+// address in *va_store.  Return NULL once all pages are visited, which
+// leaves pi_npages 0, or if the next page has no page table.  Flags:
+//	PT_ITER_CREATE: allocate a missing page table, and copy a shared
+//		one, as pgdir_walk with create does; NULL then means that
+//		there was no memory.
+//	PT_ITER_SKIP: skip pages without a page table, a whole page
+//		table's worth at a time.
+// The page table is only looked up again when the PDE changes, which
+// also catches tables freed or copied between calls.
+//
+pte_t *
+pt_iter_next(struct PtIter *it, uintptr_t *va_store, int flags)
+{
+	pde_t pde;
+	pte_t *pte;
+	size_t n;
+
+	while (it->pi_npages) {
+		*va_store = it->pi_va;
+		pde = it->pi_pgdir[PDX(it->pi_va)];
+		if (!it->pi_pt || pde != it->pi_pde) {
+			it->pi_pt = NULL;
+			if ((flags & PT_ITER_CREATE)
+			    && (!(pde & PTE_P) || pgdir_pt_shared(it->pi_pgdir, (void *) it->pi_va))) {
+				if (!pgdir_walk(it->pi_pgdir, (void *) it->pi_va, 1))
+					return NULL;
+				pde = it->pi_pgdir[PDX(it->pi_va)];
+			}
+			if (!(pde & PTE_P)) {
+				if (!(flags & PT_ITER_SKIP))
+					return NULL;
+				n = MIN(it->pi_npages, NPTENTRIES - PTX(it->pi_va));
+				it->pi_va += n * PGSIZE;
+				it->pi_npages -= n;
+				continue;
+			}
+			assert(!(pde & PTE_PS));
+			it->pi_pde = pde;
+			it->pi_pt = KADDR(PTE_ADDR(pde));
+		}
+		pte = &it->pi_pt[PTX(it->pi_va)];
+		it->pi_va += PGSIZE;
+		it->pi_npages--;
+		return pte;
+	}
+	return NULL;
+}
+
 //
 // Map [va, va+size) of virtual address space to physical [pa, pa+size)
 // in the page table rooted at pgdir.  Size is a multiple of PGSIZE.
@@ -495,23 +1552,38 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 //
 // Hint: the TA solution uses pgdir_walk
 static void
-boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
+boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, pte_t perm)
 {
 	// Fill this function in
 	assert(size==ROUNDUP(size, PGSIZE));
-	int page_s = size/PGSIZE;
-	int i, create=1;
-	for (i=0; i<page_s; i++, pa+=PGSIZE, va+=PGSIZE)//之前少了p(v)a+=PGSIZE也能过？
-	{
-		pte_t * ppte = pgdir_walk(pgdir, (void*)va, create);
-		if(ppte)
-			*ppte=(pa&0xFFFFF000)|perm|PTE_P;
-		else
-			panic("shouldn't be here.");
-	}
+	struct PtIter it;
+	pte_t * ppte;
+
+	pt_iter_init(&it, pgdir, (void *) va, size / PGSIZE);
+	for (; (ppte = pt_iter_next(&it, &va, PT_ITER_CREATE)); pa += PGSIZE)
+		*ppte=PTE_ADDR(pa)|perm|PTE_P;
+	if (it.pi_npages)
+		panic("shouldn't be here.");
 
 }
 
+//
+// Like boot_map_region, but map [va, va+size) with superpage PDEs, one
+// per PTSIZE, instead of page tables.  va, pa and size must be multiples
+// of PTSIZE, and nothing may be mapped there yet.
+//
+static void
+boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, pte_t perm)
+{
+	size_t off;
+
+	assert(va % PTSIZE == 0 && pa % PTSIZE == 0 && size % PTSIZE == 0);
+	for (off = 0; off < size; off += PTSIZE) {
+		assert(!(pgdir[PDX(va + off)] & PTE_P));
+		pgdir[PDX(va + off)] = (pa + off) | perm | PTE_PS | PTE_P;
+	}
+}
+
 //
 // Map the physical page 'pp' at virtual address 'va'.
 // The permissions (the low 12 bits) of the page table entry
@@ -532,7 +1604,8 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 //
 // RETURNS:
 //   0 on success
-//   -E_NO_MEM, if page table couldn't be allocated
+//   -E_NO_MEM, if page table couldn't be allocated, or the page's
+//   reverse map needed memory and there was none
 //
 // Hint: The TA solution is implemented using pgdir_walk, page_remove,
 // and page2pa.
@@ -547,25 +1620,44 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 
 	if(!ppte)
 		return -E_NO_MEM;
+	return page_insert_pte(pgdir, ppte, pp, va, perm);
+}
 
+//
+// page_insert, given the PTE for va in pgdir, as returned by pgdir_walk
+// or a PtIter with create set.
+//
+int
+page_insert_pte(pde_t *pgdir, pte_t *ppte, struct PageInfo *pp, void *va, int perm)
+{
+	struct PageInfo *npp;
+	struct TlbBatch tb;
 
-	if(PAGE_PRESENT(*ppte))
-	{
-		//if(va==(void*)PGSIZE) panic("tnshstnh");
-		page_remove(pgdir, va);
+	assert(!pgdir_pt_shared(pgdir, va));
+	// The zero page's pp_ref must not wrap.
+	if (!(npp = zero_page_share(pp, ALLOC_HIGHMEM | alloc_color(pgdir, va))))
+		return -E_NO_MEM;
+	// Take the new reference before removing the old mapping, so that
+	// re-inserting the same pp at the same va never frees it.  The
+	// reverse map briefly holds ppte twice in that case.  Likewise the
+	// new PTE is counted first, so the page table is not reclaimed.
+	if (rmap_add(npp, ppte) < 0) {
+		if (npp != pp)
+			page_free(npp);
+		return -E_NO_MEM;
 	}
-	// if pp is already mapped and ref is only one,
-	// then after page_remove it is free.
-	// it's gonna mapped so it's not free actually.
-	// I didn't find "the elegant way."
-	if (page_free_list==pp)
-	{// if freed pp pp should not be in the free list.
-		page_free_list = pp->pp_link;
+	pp = npp;
+	pp->pp_ref++;
+	pte2pgtable(ppte)->pp_ptcount++;
+	if(*ppte) {
+		tlb_batch_init(&tb, pgdir);
+		page_remove_pte(pgdir, va, ppte, &tb);
+		tlb_batch_flush(&tb);
 	}
 
-
 	*ppte=page2pa(pp)|perm|PTE_P;
-	pp->pp_ref++;
+	pa2page(PADDR(pgdir))->pp_nmapped++;
+	meminfo_add(&meminfo.mi_mapped, 1, &meminfo.mi_mapped_max);
 
 	return 0;
 }
@@ -586,10 +1678,11 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 {
 	// Fill this function in
 	pte_t * result = pgdir_walk(pgdir, va, 0);
-	if(result)
+	if(result && PAGE_PRESENT(*result))
 	{
-		*pte_store = result;
-		return pa2page(*result);
+		if (pte_store)
+			*pte_store = result;
+		return pa2page(PTE_ADDR(*result));
 	}
 	return NULL;
 }
@@ -597,6 +1690,8 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 //
 // Unmaps the physical page at virtual address 'va'.
 // If there is no physical page at that address, silently does nothing.
+// If the page is swapped out, its swap slot is released instead, and a
+// demand-zero page that was never touched is simply forgotten.
 //
 // Details:
 //   - The ref count on the physical page should decrement.
@@ -612,33 +1707,244 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 void
 page_remove(pde_t *pgdir, void *va)
 {
-	struct PageInfo * ppi;
+	struct TlbBatch tb;
+
+	tlb_batch_init(&tb, pgdir);
+	page_remove_batch(pgdir, va, &tb);
+	tlb_batch_flush(&tb);
+}
+
+//
+// page_remove, but queue the TLB invalidation in tb, a batch for pgdir.
+// The page is released when tb is flushed, and so is the page table if
+// that was its last PTE in use; the PDE is cleared right away.  The
+// page table must not be shared (see pgdir_unshare_pt).
+//
+void
+page_remove_batch(pde_t *pgdir, void *va, struct TlbBatch *tb)
+{
 	pte_t * ppte;
-	ppi = page_lookup(pgdir, va, &ppte);
+
+	assert(!pgdir_pt_shared(pgdir, va));
+	if ((ppte = pgdir_walk(pgdir, va, 0)) && *ppte)
+		page_remove_pte(pgdir, va, ppte, tb);
+}
+
+//
+// page_remove_batch, given the PTE for va in pgdir, which is in use.
+//
+void
+page_remove_pte(pde_t *pgdir, void *va, pte_t *ppte, struct TlbBatch *tb)
+{
+	struct PageInfo * ppi, *pt;
+
+	assert(tb->tb_pgdir == pgdir && *ppte);
 	// cprintf("page_remove pgdir: %p, va: %p, ppi is #%d:%d ref, ppte: %p\n", pgdir, va, ppi-pages,ppi->pp_ref, ppte);
-	if(ppi)
+	if(PAGE_PRESENT(*ppte))
+	{
+		ppi = pa2page(PTE_ADDR(*ppte));
+		rmap_remove(ppi, ppte);
+		*ppte = 0;
+		tlb_batch_add_page(tb, va, ppi);
+		pa2page(PADDR(pgdir))->pp_nmapped--;
+		meminfo_add(&meminfo.mi_mapped, -1, NULL);
+	}
+	else
 	{
-		page_decref(ppi);
+		// Swapped out or demand-zero.
+		if (PTE_SWAPPED(*ppte))
+			swap_free(*ppte);
 		*ppte = 0;
-		tlb_invalidate(pgdir, va);
-		if (ppi == page_free_list)
-		{ // page removed.
-			//wrong: should be set zero anyway: *ppte=0;
-			//wrong: should be tlb_invalidate anyway: tlb_invalidate(pgdir, va); //ref to 北大报告。
+	}
+
+	// A user page table left empty goes too.  Until tb is flushed,
+	// some CPU may still be walking it, or reading it through its
+	// alias in the UVPT self-mapping.
+	pt = pte2pgtable(ppte);
+	if (--pt->pp_ptcount == 0 && pgdir != kern_pgdir) {
+		pgdir[PDX(va)] = 0;
+		tlb_batch_add(tb, (void *) (UVPT + PDX(va) * PGSIZE));
+		tlb_batch_add_page(tb, va, pt);
+		meminfo_add(&meminfo.mi_pgtables_reclaimed, 1, NULL);
+	}
+}
+
+//
+// Make cpgdir map the region around va through pgdir's page table, so
+// that sys_fork does not copy its PTEs.  The table is write-protected
+// in both page directories, and the first one to change a PTE in the
+// region or to write to one of its pages gets a copy of the table (see
+// pgdir_unshare_pt).  The caller invalidates pgdir's TLB entries for
+// the region.
+// Returns 0 on success, or -E_INVAL if a page in the region is swapped
+// out: swap slots cannot be shared, having no reference count.
+//
+int
+pgdir_share_pt(pde_t *pgdir, pde_t *cpgdir, const void *va)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	pte_t *pt;
+	int i, n = 0;
+
+	assert((uintptr_t) va < UTOP && (*pde & PTE_P)
+	       && !(cpgdir[PDX(va)] & PTE_P));
+	pt = KADDR(PTE_ADDR(*pde));
+	for (i = 0; i < NPTENTRIES; i++)
+		if (PTE_SWAPPED(pt[i]))
+			return -E_INVAL;
+		else if (pt[i] & PTE_P)
+			n++;
+
+	*pde &= ~PTE_W;
+	cpgdir[PDX(va)] = *pde;
+	pa2page(PTE_ADDR(*pde))->pp_ref++;
+	pa2page(PADDR(cpgdir))->pp_nmapped += n;
+	meminfo_add(&meminfo.mi_mapped, n, &meminfo.mi_mapped_max);
+	return 0;
+}
+
+//
+// Give pgdir a page table of its own for the region around va, if it
+// shares one (see pgdir_share_pt).  The last address space left holding
+// a shared table just gets write access to it back.  Otherwise pgdir
+// gets a copy of the table, and the writable pages in it become
+// copy-on-write in both tables.
+// Returns 0 on success, or -E_NO_MEM if there was no memory for a copy.
+//
+int
+pgdir_unshare_pt(pde_t *pgdir, const void *va)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	struct PageInfo *pt, *npt, *pp, *npp;
+	struct TlbBatch tb;
+	pte_t *src, *dst;
+	int i;
+
+	if (!pgdir_pt_shared(pgdir, va))
+		return 0;
+	pt = pa2page(PTE_ADDR(*pde));
+	if (pt->pp_ref == 1) {
+		pt->pp_ptdir = pgdir;
+		*pde |= PTE_W;
+	} else {
+		if (!(npt = pgtable_alloc(pgdir, PDX(va))))
+			return -E_NO_MEM;
+		src = page2kva(pt);
+		dst = page2kva(npt);
+		for (i = 0; i < NPTENTRIES; i++) {
+			// Shared tables never have pages swapped out, so
+			// a PTE without PTE_P is empty or demand-zero.
+			if (!(src[i] & PTE_P)) {
+				dst[i] = src[i];
+				continue;
+			}
+			pp = pa2page(PTE_ADDR(src[i]));
+			if (!(npp = zero_page_share(pp, ALLOC_HIGHMEM)))
+				goto fail;
+			if (rmap_add(npp, &dst[i]) < 0) {
+				if (npp != pp)
+					page_free(npp);
+				goto fail;
+			}
+			npp->pp_ref++;
+			if (src[i] & PTE_W)
+				src[i] = (src[i] & ~PTE_W) | PTE_COW;
+			dst[i] = page2pa(npp) | PGOFF(src[i]);
 		}
+		npt->pp_ptcount = pt->pp_ptcount;
+		*pde = page2pa(npt) | PTE_P|PTE_W|PTE_U;
+		pt->pp_ref--;
 	}
+
+	// The TLB may hold read-only entries from the shared table.
+	tlb_batch_init(&tb, pgdir);
+	tlb_batch_add_range(&tb, (void *) ROUNDDOWN((uintptr_t) va, PTSIZE),
+			    NPTENTRIES);
+	tlb_batch_flush(&tb);
+	return 0;
+
+fail:
+	while (--i >= 0)
+		if (dst[i] & PTE_P) {
+			pp = pa2page(PTE_ADDR(dst[i]));
+			rmap_remove(pp, &dst[i]);
+			page_decref(pp);
+		}
+	page_decref(npt);
+	return -E_NO_MEM;
 }
 
 //
-// Invalidate a TLB entry, but only if the page tables being
-// edited are the ones currently in use by the processor.
+// If pgdir's page table for the region around va is shared with other
+// address spaces, drop pgdir's reference to it and clear the PDE,
+// leaving the PTEs to the others.
+// Returns 1 if it did, or 0 if pgdir has the table to itself.
+//
+int
+pgdir_release_shared_pt(pde_t *pgdir, const void *va)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	struct PageInfo *pt;
+	struct TlbBatch tb;
+	pte_t *ptes;
+	int i;
+
+	if (!pgdir_pt_shared(pgdir, va))
+		return 0;
+	pt = pa2page(PTE_ADDR(*pde));
+	if (pt->pp_ref == 1) {
+		// The others are gone already.
+		assert(pgdir_unshare_pt(pgdir, va) == 0);
+		return 0;
+	}
+
+	ptes = page2kva(pt);
+	for (i = 0; i < NPTENTRIES; i++)
+		if (ptes[i] & PTE_P) {
+			pa2page(PADDR(pgdir))->pp_nmapped--;
+			meminfo_add(&meminfo.mi_mapped, -1, NULL);
+		}
+	*pde = 0;
+	pt->pp_ref--;
+
+	tlb_batch_init(&tb, pgdir);
+	tlb_batch_add_range(&tb, (void *) ROUNDDOWN((uintptr_t) va, PTSIZE),
+			    NPTENTRIES);
+	tlb_batch_flush(&tb);
+	return 1;
+}
+
+//
+// Invalidate a TLB entry on every CPU that has the page tables being
+// edited in use (see kern/tlb.c).
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
-	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
-		invlpg(va);
+	struct TlbBatch tb;
+
+	// Several pages are better queued in a TlbBatch of their own.
+	tlb_batch_init(&tb, pgdir);
+	tlb_batch_add(&tb, va);
+	tlb_batch_flush(&tb);
+}
+
+//
+// Flush this CPU's whole TLB, global entries included.  lcr3 keeps
+// the global kernel mappings, so changing one of those takes this (or
+// an invlpg of each page changed).
+//
+void
+tlb_flush_all(void)
+{
+	uint32_t cr4 = rcr4();
+
+	if (cr4 & CR4_PGE) {
+		// Toggling CR4.PGE flushes global entries too.
+		lcr4(cr4 & ~CR4_PGE);
+		lcr4(cr4);
+	} else
+		lcr3(rcr3());
 }
 
 //
@@ -680,93 +1986,107 @@ mmio_map_region(physaddr_t pa, size_t size)
 	if (map_end >= MMIOLIM)
 		panic ("mmio_map_region overflowed!");
 
-	boot_map_region(kern_pgdir, map_begin, size, pa, PTE_PCD|PTE_PWT|PTE_W);
+	boot_map_region(kern_pgdir, map_begin, size, pa, PTE_PCD|PTE_PWT|PTE_W|pte_nx|pte_g);
 	base += size;
 
 	return((void*)map_begin); //我傻了居然return了一个(void*)base。
 	// panic("mmio_map_region not implemented");
 }
 
-static uintptr_t user_mem_check_addr;
-
-//
-// Check that an environment is allowed to access the range of memory
-// [va, va+len) with permissions 'perm | PTE_P'.
-// Normally 'perm' will contain PTE_U at least, but this is not required.
-// 'va' and 'len' need not be page-aligned; you must test every page that
-// contains any of that range.  You will test either 'len/PGSIZE',
-// 'len/PGSIZE + 1', or 'len/PGSIZE + 2' pages.
 //
-// A user program can access a virtual address if (1) the address is below
-// ULIM, and (2) the page table gives it permission.  These are exactly
-// the tests you should implement here.
+// Resolve a write to va in pgdir if it maps a page copy-on-write, as
+// sys_fork leaves writable pages.  The page's last mapping simply gets
+// write access back, others get a copy.  The merged pages of kern/ksm.c
+// are left to ksm_unmerge.  pgdir must not share va's page table.
+// alloc_flags are added to those of the copy's page_alloc_reclaim.  If
+// tb is not NULL, a PTE made writable in place is queued on it rather
+// than invalidated.
+// Returns 1 if it did, 0 if va is not mapped copy-on-write, and
+// -E_NO_MEM if there was no memory for the copy.
 //
-// If there is an error, set the 'user_mem_check_addr' variable to the first
-// erroneous virtual address.
+int
+page_cow_fault(pde_t *pgdir, void *va, int alloc_flags, struct TlbBatch *tb)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	int perm, r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	pte = pgdir_walk(pgdir, va, 0);
+	if (!pte || (*pte & (PTE_P|PTE_COW)) != (PTE_P|PTE_COW))
+		return 0;
+	pp = pa2page(PTE_ADDR(*pte));
+	if (pp->pp_flags & PP_KSM)
+		return 0;
+	assert(!pgdir_pt_shared(pgdir, va));
+	perm = ((*pte & PTE_SYSCALL) & ~PTE_COW) | PTE_W;
+
+	if (pp->pp_ref == 1) {
+		*pte = page2pa(pp) | perm;
+		if (tb)
+			tlb_batch_add(tb, va);
+		else
+			tlb_invalidate(pgdir, va);
+		meminfo_add(&meminfo.mi_cow_reused, 1, NULL);
+		return 1;
+	}
+	if ((r = page_copy_insert(pgdir, pp, va, perm, alloc_flags)) < 0)
+		return r;
+	meminfo_add(&meminfo.mi_cow_copied, 1, NULL);
+	return 1;
+}
+
 //
-// Returns 0 if the user program can access this range of addresses,
-// and -E_FAULT otherwise.
+// Map a private copy of pp at va in pgdir with permissions perm, in
+// place of whatever is mapped there.  pp must be mapped more than
+// once, so that reclaiming memory for the copy cannot swap it out.
+// alloc_flags are added to those of the copy's page_alloc_reclaim.
+// Returns 0 on success, or -E_NO_MEM.
 //
 int
-user_mem_check(struct Env *env, const void *va, size_t len, int perm)
+page_copy_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm,
+		 int alloc_flags)
 {
-	// LAB 3: Your code here.
-	const char* s = (const char*) va;
-	uintptr_t start = (uintptr_t) ROUNDDOWN(s, PGSIZE);
-	uintptr_t end = (uintptr_t) ROUNDUP(s+len, PGSIZE);
-	uintptr_t iter;
-	int die = 0;
-	for (iter=start; iter<end; iter+=PGSIZE)
-	{
-		int non_create = 0;
-		pte_t * ppte = pgdir_walk(env->env_pgdir, (void*) iter, non_create);
-		if (!ppte)
-		{ //secondary page table not present or page not present.
-			die = 1;
-			break;
-		}
-		else if (!PAGE_PRESENT(*ppte))
-		{
-			die = 2;
-			break;
-		}
-		else if (iter > ULIM)
-		{ // 越界了
-			die = 3;
-			break;
-		}
-		else if ((*ppte & (perm|PTE_P)) != (perm|PTE_P))
-		{ // no user permission.
-			die = 4;
-			break;
-		}
-	}
-	if (die)
-	{
-		cprintf("pmap.c:746 user_mem_check fault #%d, s is %p, len is %x\n", die, s, len);
-		user_mem_check_addr = iter+((uintptr_t)s-start);
-		// cprintf("[%08x] user_mem_check assertion failure for va %08x\n", env->env_id, iter+((uintptr_t)s-start));
-		return -E_FAULT;
-	}
+	struct PageInfo *npp;
+	void *src, *dst;
+	int r;
 
-	return 0;
+	assert(pp->pp_ref > 1);
+	if (!(npp = page_alloc_reclaim(ALLOC_HIGHMEM | alloc_color(pgdir, va)
+				       | alloc_flags)))
+		return -E_NO_MEM;
+	src = kmap(pp);
+	dst = kmap(npp);
+	memcpy(dst, src, PGSIZE);
+	kunmap(dst);
+	kunmap(src);
+	if ((r = page_insert(pgdir, npp, va, perm)) < 0)
+		page_free(npp);
+	return r;
 }
 
 //
-// Checks that environment 'env' is allowed to access the range
-// of memory [va, va+len) with permissions 'perm | PTE_U | PTE_P'.
-// If it can, then the function simply returns.
-// If it cannot, 'env' is destroyed and, if env is the current
-// environment, this function will not return.
+// Make sure the user page at va in pgdir is present before the kernel
+// touches it: bring it back from swap, or map it if it is demand-zero.
+// If the kernel is going to write to it, also give pgdir its own page
+// table if it shares one since sys_fork, and give the page a private
+// copy if it is shared copy-on-write, since sys_fork or by kern/ksm.c
+// or kern/zeropage.c.
+// Returns 0 on success, including if nothing is mapped at va, or
+// < 0 on error.
 //
-void
-user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
+int
+user_page_prepare(pde_t *pgdir, void *va, bool write)
 {
-	if (user_mem_check(env, va, len, perm | PTE_U) < 0) {
-		cprintf("[%08x] user_mem_check assertion failure for "
-			"va %08x\n", env->env_id, user_mem_check_addr);
-		env_destroy(env);	// may not return
-	}
+	int r;
+
+	if ((write && (r = pgdir_unshare_pt(pgdir, va)) < 0)
+	    || (r = swap_in(pgdir, va)) < 0
+	    || (r = zero_page_fault(pgdir, va, write, 0)) < 0
+	    || (write && (r = ksm_unmerge(pgdir, va)) < 0)
+	    || (write && (r = page_cow_fault(pgdir, va, 0, NULL)) < 0))
+		return r;
+	return 0;
 }
 
 
@@ -775,67 +2095,98 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // --------------------------------------------------------------
 
 //
-// Check that the pages on the page_free_list are reasonable.
+// Check that the pages on the buddy allocator's free lists are reasonable.
 //
 static void
 check_page_free_list(bool only_low_memory)
 {
-	struct PageInfo *pp;
+	struct PageInfo *blk, *pp;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
 	char *first_free_page;
+	int zone, order;
+	size_t i;
 
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
-
-	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
-		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
-	}
-	// if there's a page that shouldn't be on the free list,
-	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-		{
-			memset(page2kva(pp), 0x97, 128);
-		}
+	if (!page_nfree())
+		panic("the page allocator has no free pages!");
+
+	// The buddy allocator only holds pages below boot_mapsize until
+	// page_init_high runs, so there is nothing to reorder for
+	// entry_pgdir here.
 	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
+	for (zone = 0; zone < NZONES; zone++)
+	for (order = 0; order <= PAGE_MAX_ORDER; order++)
+	for (blk = page_free_area[zone][order].fa_head; blk; blk = blk->pp_link) {
 		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-		// (new test for lab 4)
-		assert(page2pa(pp) != MPENTRY_PADDR);
-
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
+		assert(blk >= pages);
+		assert(blk + (1 << order) <= pages + npages);
+		assert(((char *) blk - (char *) pages) % sizeof(*blk) == 0);
+		assert((blk->pp_flags & PP_FREE) && blk->pp_order == order);
+		assert(((blk - pages) & ((1 << order) - 1)) == 0);
+		assert(!blk->pp_link || blk->pp_link->pp_prev == blk);
+		assert(page_zone(blk) == zone);
+
+		for (i = 0, pp = blk; i < (1 << order); i++, pp++) {
+			// if there's a page that shouldn't be on the free
+			// list, try to make sure it eventually causes trouble.
+			if (PDX(page2pa(pp)) < pdx_limit && !page_is_high(pp))
+				memset(page2kva(pp), 0x97, 128);
+
+			// check a few pages that shouldn't be on the free list
+			assert(pp->pp_ref == 0);
+			assert(page2pa(pp) != 0);
+			assert(page2pa(pp) != IOPHYSMEM);
+			assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+			assert(page2pa(pp) != EXTPHYSMEM);
+			assert(page2pa(pp) < EXTPHYSMEM || page2pa(pp) >= PADDR(first_free_page));
+			// (new test for lab 4)
+			assert(page2pa(pp) != MPENTRY_PADDR);
+
+			if (page2pa(pp) < EXTPHYSMEM)
+				++nfree_basemem;
+			else
+				++nfree_extmem;
+		}
 	}
 
 	assert(nfree_basemem > 0);
 	assert(nfree_extmem > 0);
 }
 
+//
+// Take every free block out of the buddy allocator, chained through
+// pp_link with pp_order kept, so the checks below can run the
+// allocator dry.  page_free_unstash gives them back.
+//
+static struct PageInfo *
+page_free_stash(void)
+{
+	struct PageInfo *list = NULL, *pp;
+	int zone, order;
+
+	for (zone = 0; zone < NZONES; zone++)
+		for (order = 0; order <= PAGE_MAX_ORDER; order++)
+			while ((pp = page_free_area[zone][order].fa_head)) {
+				free_area_del(pp, order);
+				pp->pp_order = order;
+				pp->pp_link = list;
+				list = pp;
+			}
+	return list;
+}
+
+static void
+page_free_unstash(struct PageInfo *list)
+{
+	struct PageInfo *pp;
+
+	while ((pp = list)) {
+		list = pp->pp_link;
+		pp->pp_link = NULL;
+		buddy_free(pp, pp->pp_order);
+	}
+}
+
 //
 // Check the physical page allocator (page_alloc(), page_free(),
 // and page_init()).
@@ -853,8 +2204,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = page_nfree();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -870,8 +2220,7 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = page_free_stash();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -899,7 +2248,7 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	page_free_unstash(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -907,9 +2256,22 @@ check_page_alloc(void)
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	assert(page_nfree() == nfree);
+
+	// contiguous blocks are aligned to their size, and freeing
+	// them coalesces the buddies back together
+	assert((pp0 = page_alloc_npages(2, ALLOC_ZERO)));
+	assert((pp1 = page_alloc_npages(0, 0)));
+	assert(((pp0 - pages) & 3) == 0);
+	assert(pp1 < pp0 || pp1 >= pp0 + 4);
+	c = page2kva(pp0);
+	for (i = 0; i < 4 * PGSIZE; i++)
+		assert(c[i] == 0);
+	assert(page_nfree() == nfree - 5);
+	assert(!page_alloc_npages(PAGE_MAX_ORDER + 1, 0));
+	page_free_npages(pp1, 0);
+	page_free_npages(pp0, 2);
+	assert(page_nfree() == nfree);
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
@@ -931,7 +2293,7 @@ check_kern_pgdir(void)
 	pgdir = kern_pgdir;
 
 	// check pages array
-	n = ROUNDUP(npages*sizeof(struct PageInfo), PGSIZE);
+	n = MIN(ROUNDUP(npages*sizeof(struct PageInfo), PGSIZE), PTSIZE);
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UPAGES + i) == PADDR(pages) + i);
 
@@ -941,8 +2303,10 @@ check_kern_pgdir(void)
 		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
 
 	// check phys mem
-	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
+	for (i = 0; i < npages_lowmem * PGSIZE; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
+	for (i = 0; i < HIGHMEM; i += PTSIZE)
+		assert((pgdir[PDX(KERNBASE + i)] & (PTE_PS|PTE_G)) == (PTE_PS|pte_g));
 
 	// check kernel stack
 	// (updated in lab 4 to check per-CPU kernel stacks)
@@ -957,8 +2321,11 @@ check_kern_pgdir(void)
 
 	// check PDE permissions
 	for (i = 0; i < NPDENTRIES; i++) {
+		if (i >= PDX(UVPT) && i < PDX(UVPT + UVPTSIZE)) {
+			assert(pgdir[i] & PTE_P);
+			continue;
+		}
 		switch (i) {
-		case PDX(UVPT):
 		case PDX(KSTACKTOP-1):
 		case PDX(UPAGES):
 		case PDX(UENVS):
@@ -995,6 +2362,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 #endif
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PTE_ADDR(*pgdir) + (va & (PTSIZE - 1) & ~(PGSIZE - 1));
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 #ifdef CHECK_VA2PA
 	cprintf("p is %p\n", p);
@@ -1028,8 +2397,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = page_free_stash();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1146,7 +2514,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	page_free_unstash(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -1179,6 +2547,30 @@ check_page(void)
 	cprintf("check_page() succeeded!\n");
 }
 
+// check that ALLOC_COLOR requests get pages of the asked-for color
+static void
+check_page_color(void)
+{
+	struct PageInfo *pp[2 * PAGE_MAX_COLORS];
+	int i, flags;
+
+	if (page_ncolors == 1)
+		return;
+	for (i = 0; i < 2 * page_ncolors; i++) {
+		assert((pp[i] = page_alloc(ALLOC_COLOR | (i << ALLOC_COLOR_SHIFT))));
+		assert(page_color(pp[i]) == i % page_ncolors);
+	}
+	for (i = 0; i < 2 * page_ncolors; i++)
+		page_free(pp[i]);
+
+	// consecutive virtual pages get consecutive colors
+	flags = alloc_color(kern_pgdir, 0);
+	for (i = 1; i < 2 * page_ncolors; i++)
+		assert(((alloc_color(kern_pgdir, (void *) (i * PGSIZE)) - flags)
+			>> ALLOC_COLOR_SHIFT) % page_ncolors == i % page_ncolors);
+	cprintf("check_page_color() succeeded!\n");
+}
+
 // check page_insert, page_remove, &c, with an installed kern_pgdir
 static void
 check_page_installed_pgdir(void)
@@ -1187,6 +2579,7 @@ check_page_installed_pgdir(void)
 	struct PageInfo *fl;
 	pte_t *ptep, *ptep1;
 	uintptr_t va;
+	uint32_t *kva0, *kva1;
 	int i;
 
 	// check that we can read and write installed pages
@@ -1218,9 +2611,107 @@ check_page_installed_pgdir(void)
 	// free the pages we took
 	page_free(pp0);
 
+	// remapping a global page is seen after tlb_flush_all
+	assert((pp1 = page_alloc(0)));
+	assert((pp2 = page_alloc(0)));
+	memset(page2kva(pp1), 5, PGSIZE);
+	memset(page2kva(pp2), 6, PGSIZE);
+	assert(page_insert(kern_pgdir, pp1, (void*) PGSIZE, PTE_W | pte_g) == 0);
+	assert(*(uint32_t *)PGSIZE == 0x05050505U);
+	ptep = pgdir_walk(kern_pgdir, (void*) PGSIZE, 0);
+	*ptep = page2pa(pp2) | PTE_P | PTE_W | pte_g;
+	tlb_flush_all();
+	assert(*(uint32_t *)PGSIZE == 0x06060606U);
+	*ptep = page2pa(pp1) | PTE_P | PTE_W | pte_g;
+	tlb_flush_all();
+	page_remove(kern_pgdir, (void*) PGSIZE);
+	page_free(pp2);
+	page_decref(pa2page(PTE_ADDR(kern_pgdir[0])));
+	kern_pgdir[0] = 0;
+
+	// check kmap: high memory is used first when allowed, and nested
+	// mappings of the same page see the same data
+	assert((pp0 = page_alloc(ALLOC_HIGHMEM | ALLOC_ZERO)));
+	assert(page_is_high(pp0) == (npages > npages_lowmem));
+	kva0 = kmap(pp0);
+	assert(*kva0 == 0);
+	*kva0 = 0x04040404U;
+	kva1 = kmap(pp0);
+	assert(*kva1 == 0x04040404U);
+	assert(page_is_high(pp0) == (kva1 != kva0));
+	kunmap(kva1);
+	kunmap(kva0);
+	page_free(pp0);
+
 	cprintf("check_page_installed_pgdir() succeeded!\n");
 }
 
+// Share a page table between two scratch address spaces, and take it
+// apart again from both ends.
+static void
+check_pgdir_share(void)
+{
+	struct PageInfo *pp1, *pp2, *pt;
+	pde_t *pgdir[2];
+	pte_t *pte[2];
+	void *va = (void *) UTEXT;
+	int i;
+
+	assert((pgdir[0] = pgdir_alloc()));
+	assert((pgdir[1] = pgdir_alloc()));
+	assert((pp1 = page_alloc(ALLOC_HIGHMEM)));
+	assert((pp2 = page_alloc(ALLOC_HIGHMEM)));
+	assert(page_insert(pgdir[0], pp1, va, PTE_U|PTE_W) == 0);
+	assert(page_insert(pgdir[0], pp2, va + PGSIZE, PTE_U) == 0);
+	pt = pa2page(PTE_ADDR(pgdir[0][PDX(va)]));
+
+	// one table, write-protected in both, nothing copied
+	assert(pgdir_share_pt(pgdir[0], pgdir[1], va) == 0);
+	assert(pgdir[0][PDX(va)] == pgdir[1][PDX(va)]);
+	assert(pgdir_pt_shared(pgdir[0], va) && pgdir_pt_shared(pgdir[1], va));
+	assert(pt->pp_ref == 2 && pp1->pp_ref == 1 && pp2->pp_ref == 1);
+	assert(page_lookup(pgdir[1], va, NULL) == pp1);
+	assert(pgdir_nmapped(pgdir[1]) == 2);
+
+	// a change on one side copies the table, writable pages go COW
+	assert((pte[1] = pgdir_walk(pgdir[1], va, 1)));
+	assert(!pgdir_pt_shared(pgdir[1], va) && pgdir_pt_shared(pgdir[0], va));
+	assert(PTE_ADDR(pgdir[1][PDX(va)]) != page2pa(pt) && pt->pp_ref == 1);
+	assert(pp1->pp_ref == 2 && pp2->pp_ref == 2);
+	assert(rmap_count(pp1) == 2);
+	pte[0] = pgdir_walk(pgdir[0], va, 0);
+	for (i = 0; i < 2; i++) {
+		assert((pte[i][0] & (PTE_W|PTE_COW)) == PTE_COW);
+		assert(!(pte[i][1] & (PTE_W|PTE_COW)));
+	}
+
+	// the last one holding the table gets it back as it is
+	assert(pgdir_unshare_pt(pgdir[0], va) == 0);
+	assert(!pgdir_pt_shared(pgdir[0], va));
+	assert(PTE_ADDR(pgdir[0][PDX(va)]) == page2pa(pt) && pt->pp_ref == 1);
+
+	// a write to a COW page copies it, until only one mapping is left
+	assert(page_cow_fault(pgdir[1], va + PGSIZE, 0, NULL) == 0);
+	assert(page_cow_fault(pgdir[1], va, 0, NULL) == 1);
+	assert(page_lookup(pgdir[1], va, NULL) != pp1 && pp1->pp_ref == 1);
+	assert((pte[1][0] & (PTE_W|PTE_COW)) == PTE_W);
+	assert(page_cow_fault(pgdir[0], va, 0, NULL) == 1);
+	assert(page_lookup(pgdir[0], va, NULL) == pp1);
+	assert((pte[0][0] & (PTE_W|PTE_COW)) == PTE_W);
+
+	// emptied page tables are reclaimed
+	for (i = 0; i < 2; i++) {
+		page_remove(pgdir[i], va);
+		assert(pgdir[i][PDX(va)] & PTE_P);
+		page_remove(pgdir[i], va + PGSIZE);
+		assert(pgdir_nmapped(pgdir[i]) == 0);
+		assert(!(pgdir[i][PDX(va)] & PTE_P));
+		pgdir_free(pgdir[i]);
+	}
+	assert(pp1->pp_ref == 0 && pp2->pp_ref == 0);
+	cprintf("check_pgdir_share() succeeded!\n");
+}
+
 
 
 
@@ -9,14 +9,19 @@
 #include <inc/memlayout.h>
 #include <inc/assert.h>
 struct Env;
+struct TlbBatch;
 
 extern char bootstacktop[], bootstack[];
 
 extern struct PageInfo *pages;
 extern size_t npages;
+extern size_t npages_lowmem;	// Pages below HIGHMEM, reachable via KADDR
 
 extern pde_t *kern_pgdir;
 
+// entry_pgdir (kern/entrypgdir.c) maps this much physical memory at KERNBASE.
+#define ENTRY_MAPSIZE	0x400000
+
 #define PAGE_PRESENT(page_some_entry) ((page_some_entry)&PTE_P)
 /* This macro takes a kernel virtual address -- an address that points above
  * KERNBASE, where the machine's maximum 256MB of physical memory is mapped --
@@ -30,11 +35,12 @@ _paddr(const char *file, int line, void *kva)
 {
 	if ((uint32_t)kva < KERNBASE)
 		_panic(file, line, "PADDR called with invalid kva %08lx", kva);
-	return (physaddr_t)kva - KERNBASE;
+	return (physaddr_t)(uintptr_t)kva - KERNBASE;
 }
 
 /* This macro takes a physical address and returns the corresponding kernel
- * virtual address.  It panics if you pass an invalid physical address. */
+ * virtual address.  It panics if you pass an invalid physical address,
+ * including one in high memory: use kmap for those. */
 #define KADDR(pa) _kaddr(__FILE__, __LINE__, pa)
 /**
   * physical address to kernel virtual address.
@@ -42,33 +48,92 @@ _paddr(const char *file, int line, void *kva)
 static inline void*
 _kaddr(const char *file, int line, physaddr_t pa)
 {
-	if (PGNUM(pa) >= npages)
-		_panic(file, line, "KADDR called with invalid pa %08lx", pa);
-	return (void *)(pa + KERNBASE);
+	if (pa >> PGSHIFT >= npages_lowmem)
+		_panic(file, line, "KADDR called with invalid pa %08llx", (uint64_t)pa);
+	return (void *)(uintptr_t)(pa + KERNBASE);
 }
 
 
 enum {
 	// For page_alloc, zero the returned physical page.
 	ALLOC_ZERO = 1<<0,
+	// The caller doesn't need a KADDR for the page: prefer high memory.
+	ALLOC_HIGHMEM = 1<<1,
+	// With page coloring on, prefer a page of the cache color in the
+	// bits from ALLOC_COLOR_SHIFT up; see alloc_color.
+	ALLOC_COLOR = 1<<2,
+	// For page_alloc_reclaim, fail instead of swapping pages out.
+	ALLOC_NORECLAIM = 1<<3,
 };
 
+#define ALLOC_COLOR_SHIFT	8
+#define PAGE_MAX_COLORS		64
+
+// The buddy allocator hands out blocks of 2^order contiguous pages,
+// aligned to their size, for order in [0, PAGE_MAX_ORDER].
+// An order-PAGE_MAX_ORDER block is 4MB, i.e. one superpage.
+#define PAGE_MAX_ORDER	10
+
+// Values of pp_flags in struct PageInfo
+#define PP_FREE		0x01	// Page heads a free block in the buddy allocator
+#define PP_SLAB		0x02	// Page belongs to a kmem slab of order pp_order
+#define PP_KMALLOC	0x04	// Page heads a large kmalloc block of order pp_order
+#define PP_PGTABLE	0x08	// Page is a page table allocated by pgdir_walk
+#define PP_KSM		0x10	// Page is shared read-only by kern/ksm.c
+
+extern struct MemInfo meminfo;
+
 void	mem_init(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_npages(int order, int alloc_flags);
+void	page_free_npages(struct PageInfo *pp, int order);
+void	page_zero_idle(void);
+int	page_init_deferred(void);
+void	page_zero_tick(void);
+void	meminfo_add(uint32_t *counter, int n, uint32_t *max);
+void	meminfo_read(struct MemInfo *info, pde_t *pgdir);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+int	page_insert_pte(pde_t *pgdir, pte_t *pte, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
+void	page_remove_batch(pde_t *pgdir, void *va, struct TlbBatch *tb);
+void	page_remove_pte(pde_t *pgdir, void *va, pte_t *pte, struct TlbBatch *tb);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_flush_all(void);
+
+void	mem_init_percpu(void);
+void	pgdir_load(pde_t *pgdir);
+pde_t *	pgdir_alloc(void);
+void	pgdir_free(pde_t *pgdir);
+int	pgdir_share_pt(pde_t *pgdir, pde_t *cpgdir, const void *va);
+int	pgdir_unshare_pt(pde_t *pgdir, const void *va);
+int	pgdir_release_shared_pt(pde_t *pgdir, const void *va);
+
+void *	kmap(struct PageInfo *pp);
+void	kunmap(void *kva);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
-int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
-void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
+int	page_cow_fault(pde_t *pgdir, void *va, int alloc_flags, struct TlbBatch *tb);
+int	page_copy_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm, int alloc_flags);
+int	user_page_prepare(pde_t *pgdir, void *va, bool write);
+
+// page_alloc flags for a user page to be mapped at va in pgdir.  The
+// color follows the virtual address, so that a buffer is spread over
+// the cache evenly, rotated by the page directory's own page number so
+// that address spaces don't all crowd the same sets.
+static inline int
+alloc_color(pde_t *pgdir, void *va)
+{
+	uint32_t color = PGNUM(va) + PGNUM(PADDR(pgdir));
+
+	return ALLOC_COLOR | ((color % PAGE_MAX_COLORS) << ALLOC_COLOR_SHIFT);
+}
 
 /**
   * page to physical address.
@@ -76,7 +141,7 @@ void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
 static inline physaddr_t
 page2pa(struct PageInfo *pp)
 {
-	return (pp - pages) << PGSHIFT;
+	return (physaddr_t)(pp - pages) << PGSHIFT;
 }
 
 /**
@@ -85,14 +150,24 @@ page2pa(struct PageInfo *pp)
 static inline struct PageInfo*
 pa2page(physaddr_t pa)
 {
-	if (PGNUM(pa) >= npages)
+	if (pa >> PGSHIFT >= npages)
 		panic("pa2page called with invalid pa");
-	return &pages[PGNUM(pa)];
+	return &pages[pa >> PGSHIFT];
+}
+
+/**
+  * whether the page lies in high memory, i.e. has no KADDR.
+  */
+static inline bool
+page_is_high(struct PageInfo *pp)
+{
+	return pp - pages >= npages_lowmem;
 }
 
 /**
   * page to kernel virtual address.
   * aka. KERNBASE+physical address.
+  * high memory pages must be accessed through kmap instead.
   */
 static inline void*
 page2kva(struct PageInfo *pp)
@@ -102,4 +177,65 @@ page2kva(struct PageInfo *pp)
 
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
 
+// Walks the PTEs of a range of pages in an address space, holding on to
+// the page table of the current page rather than walking the page
+// directory for each one (see pt_iter_next).
+struct PtIter {
+	pde_t *pi_pgdir;
+	uintptr_t pi_va;		// Next page to visit
+	size_t pi_npages;		// Pages left to visit, from pi_va
+	pde_t pi_pde;			// PDE that pi_pt was found through
+	pte_t *pi_pt;			// Page table of pi_va, or NULL
+};
+
+// pt_iter_next flags
+#define PT_ITER_CREATE	0x1	// Allocate missing page tables
+#define PT_ITER_SKIP	0x2	// Skip pages that have no page table
+
+void	pt_iter_init(struct PtIter *it, pde_t *pgdir, const void *va, size_t npages);
+pte_t	*pt_iter_next(struct PtIter *it, uintptr_t *va_store, int flags);
+
+/**
+  * the page table page that pte is in.
+  */
+static inline struct PageInfo *
+pte2pgtable(pte_t *pte)
+{
+	return pa2page(PADDR(ROUNDDOWN(pte, PGSIZE)));
+}
+
+/**
+  * the value to load into %cr3 to switch to pgdir.
+  * with PAE that is its page directory pointer table.
+  */
+static inline physaddr_t
+pgdir_cr3(pde_t *pgdir)
+{
+#ifdef JOS_PAE
+	return PADDR(pa2page(PADDR(pgdir))->pp_pdpt);
+#else
+	return PADDR(pgdir);
+#endif
+}
+
+/**
+  * number of user pages mapped in the address space of pgdir.
+  */
+static inline uint32_t
+pgdir_nmapped(pde_t *pgdir)
+{
+	return pa2page(PADDR(pgdir))->pp_nmapped;
+}
+
+/**
+  * whether pgdir's page table for the user address va is shared with
+  * other address spaces, and so write-protected (see pgdir_share_pt).
+  */
+static inline bool
+pgdir_pt_shared(pde_t *pgdir, const void *va)
+{
+	return (uintptr_t) va < UTOP
+		&& (pgdir[PDX(va)] & (PTE_P|PTE_W)) == PTE_P;
+}
+
 #endif /* !JOS_KERN_PMAP_H */
@@ -0,0 +1,314 @@
+/* See COPYRIGHT for copyright information. */
+
+/*
+ * Reverse mapping: from a physical page to the page table entries
+ * that map it.
+ *
+ * page_insert and page_remove keep each page's reverse map up to date.
+ * Most pages are mapped once or twice, which fits in the PageInfo; a
+ * page mapped more often gets a chain of RmapChain nodes from the slab
+ * allocator.  A PTE pointer leads back to its address space and
+ * virtual address through the PageInfo of its page table, which
+ * pgdir_walk fills in when it creates the page table.
+ */
+
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/rmap.h>
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
+
+static struct KmemCache *rmap_chain_cache;
+
+static void check_rmap(void);
+
+void
+rmap_init(void)
+{
+	rmap_chain_cache = kmem_cache_create("rmap_chain",
+					     sizeof(struct RmapChain),
+					     sizeof(void *));
+	if (!rmap_chain_cache)
+		panic("rmap_init: cannot create chain cache");
+	check_rmap();
+}
+
+// The head of pp's chain, or NULL if its PTEs are kept inline.
+static struct RmapChain *
+rmap_chain(struct PageInfo *pp)
+{
+	uintptr_t head = (uintptr_t) pp->pp_rmap[0];
+
+	if (!(head & RMAP_CHAIN))
+		return NULL;
+	return (struct RmapChain *) (head & ~RMAP_CHAIN);
+}
+
+static void
+rmap_set_chain(struct PageInfo *pp, struct RmapChain *rc)
+{
+	pp->pp_rmap[0] = (pte_t *) ((uintptr_t) rc | RMAP_CHAIN);
+	pp->pp_rmap[1] = NULL;
+}
+
+// Chains are only needed for pages mapped three times or more, which
+// does not happen before rmap_init.
+static struct RmapChain *
+rmap_chain_alloc(void)
+{
+	struct RmapChain *rc;
+
+	if (!rmap_chain_cache || !(rc = kmem_cache_alloc(rmap_chain_cache)))
+		return NULL;
+	memset(rc, 0, sizeof(*rc));
+	return rc;
+}
+
+//
+// Record that pte maps pp.
+// Returns 0 on success, or -E_NO_MEM if a chain node was needed and
+// could not be allocated.
+//
+int
+rmap_add(struct PageInfo *pp, pte_t *pte)
+{
+	struct RmapChain *rc, *nrc;
+	int i;
+
+	if (!(rc = rmap_chain(pp))) {
+		if (!pp->pp_rmap[0])
+			pp->pp_rmap[0] = pte;
+		else if (!pp->pp_rmap[1])
+			pp->pp_rmap[1] = pte;
+		else {
+			// Move both inline PTEs to a new chain.
+			if (!(nrc = rmap_chain_alloc()))
+				return -E_NO_MEM;
+			nrc->rc_ptes[0] = pp->pp_rmap[0];
+			nrc->rc_ptes[1] = pp->pp_rmap[1];
+			nrc->rc_ptes[2] = pte;
+			rmap_set_chain(pp, nrc);
+		}
+		return 0;
+	}
+
+	for (i = 0; i < RMAP_CHAIN_NPTES; i++)
+		if (!rc->rc_ptes[i]) {
+			rc->rc_ptes[i] = pte;
+			return 0;
+		}
+	if (!(nrc = rmap_chain_alloc()))
+		return -E_NO_MEM;
+	nrc->rc_next = rc;
+	nrc->rc_ptes[0] = pte;
+	rmap_set_chain(pp, nrc);
+	return 0;
+}
+
+//
+// Forget that pte maps pp.  It is a bug if it wasn't recorded.
+//
+void
+rmap_remove(struct PageInfo *pp, pte_t *pte)
+{
+	struct RmapChain *head, *rc;
+	int i, last;
+
+	if (!(head = rmap_chain(pp))) {
+		if (pp->pp_rmap[0] == pte) {
+			pp->pp_rmap[0] = pp->pp_rmap[1];
+			pp->pp_rmap[1] = NULL;
+		} else if (pp->pp_rmap[1] == pte)
+			pp->pp_rmap[1] = NULL;
+		else
+			panic("rmap_remove: pte %08x does not map page %08x",
+			      pte, page2pa(pp));
+		return;
+	}
+
+	for (rc = head; rc; rc = rc->rc_next)
+		for (i = 0; i < RMAP_CHAIN_NPTES; i++)
+			if (rc->rc_ptes[i] == pte)
+				goto found;
+	panic("rmap_remove: pte %08x does not map page %08x", pte, page2pa(pp));
+
+found:
+	// Fill the hole with the head node's last PTE.
+	for (last = 0; last + 1 < RMAP_CHAIN_NPTES && head->rc_ptes[last + 1];
+	     last++)
+		/* do nothing */;
+	rc->rc_ptes[i] = head->rc_ptes[last];
+	head->rc_ptes[last] = NULL;
+
+	if (!head->rc_ptes[0]) {
+		// Only the last node can empty out, other nodes are full.
+		assert(head->rc_next);
+		rmap_set_chain(pp, head->rc_next);
+		kmem_cache_free(rmap_chain_cache, head);
+	} else if (!head->rc_next && !head->rc_ptes[2]) {
+		// Back down to two PTEs, which fit inline.
+		pp->pp_rmap[0] = head->rc_ptes[0];
+		pp->pp_rmap[1] = head->rc_ptes[1];
+		kmem_cache_free(rmap_chain_cache, head);
+	}
+}
+
+//
+// Return the number of PTEs mapping pp.
+//
+int
+rmap_count(struct PageInfo *pp)
+{
+	struct RmapIter it;
+	int n = 0;
+
+	rmap_iter_init(&it, pp);
+	while (rmap_iter_next(&it))
+		n++;
+	return n;
+}
+
+void
+rmap_iter_init(struct RmapIter *it, struct PageInfo *pp)
+{
+	it->ri_page = pp;
+	it->ri_chain = rmap_chain(pp);
+	it->ri_index = 0;
+}
+
+//
+// Return the next PTE mapping the iterator's page, or NULL if there
+// are no more.
+//
+pte_t *
+rmap_iter_next(struct RmapIter *it)
+{
+	pte_t *pte;
+
+	if (!it->ri_chain) {
+		while (it->ri_index < 2)
+			if ((pte = it->ri_page->pp_rmap[it->ri_index++]))
+				return pte;
+		return NULL;
+	}
+	while (it->ri_index == RMAP_CHAIN_NPTES
+	       || !(pte = it->ri_chain->rc_ptes[it->ri_index])) {
+		if (!(it->ri_chain = it->ri_chain->rc_next)) {
+			// Done: the inline case has nothing to return.
+			it->ri_index = 2;
+			return NULL;
+		}
+		it->ri_index = 0;
+	}
+	it->ri_index++;
+	return pte;
+}
+
+// The PageInfo of the page table that pte is in.
+static struct PageInfo *
+rmap_ptpage(pte_t *pte)
+{
+	struct PageInfo *pt = pte2pgtable(pte);
+
+	assert(pt->pp_flags & PP_PGTABLE);
+	return pt;
+}
+
+//
+// Return the page directory that pte is in.
+//
+pde_t *
+rmap_pgdir(pte_t *pte)
+{
+	return rmap_ptpage(pte)->pp_ptdir;
+}
+
+//
+// Return the virtual address that pte maps.
+//
+uintptr_t
+rmap_va(pte_t *pte)
+{
+	return (uintptr_t) PGADDR(rmap_ptpage(pte)->pp_ptpdx,
+				  PGOFF(pte) / sizeof(pte_t), 0);
+}
+
+// Mappings made by check_rmap: enough for a chain of three nodes.
+#define CHECK_RMAP_NMAPS	(2 * RMAP_CHAIN_NPTES + 3)
+
+// Where check_rmap's i'th mapping goes: alternately in each of two
+// address spaces, two pages per page table in each.
+static uintptr_t
+check_rmap_va(int i)
+{
+	return UTEXT + (i / 2) * PGSIZE + (i / 4) * PTSIZE;
+}
+
+// Map one page at many addresses, and check what the reverse map says
+// as the mappings come and go.
+static void
+check_rmap(void)
+{
+	struct PageInfo *pp;
+	struct RmapIter it;
+	pde_t *pgdir[2];
+	pte_t *pte;
+	uintptr_t va;
+	int i, n, seen;
+	const int nmaps = CHECK_RMAP_NMAPS;
+
+	static_assert(CHECK_RMAP_NMAPS < 32);
+	assert((pgdir[0] = pgdir_alloc()));
+	assert((pgdir[1] = pgdir_alloc()));
+	assert((pp = page_alloc(ALLOC_HIGHMEM)));
+	assert(rmap_count(pp) == 0);
+	// Our own reference keeps pp allocated once it is unmapped.
+	pp->pp_ref++;
+
+	for (i = 0; i < nmaps; i++) {
+		va = check_rmap_va(i);
+		assert(page_insert(pgdir[i % 2], pp, (void *) va, PTE_U) == 0);
+		assert(rmap_count(pp) == i + 1);
+		assert(!rmap_chain(pp) == (i < 2));
+	}
+
+	// Each mapping shows up once, with its own address space and va.
+	seen = 0;
+	rmap_iter_init(&it, pp);
+	while ((pte = rmap_iter_next(&it))) {
+		assert(PTE_ADDR(*pte) == page2pa(pp));
+		for (i = 0; i < nmaps; i++)
+			if (rmap_pgdir(pte) == pgdir[i % 2]
+			    && rmap_va(pte) == check_rmap_va(i))
+				break;
+		assert(i < nmaps && !(seen & (1 << i)));
+		seen |= 1 << i;
+	}
+	assert(seen == (1 << nmaps) - 1);
+
+	// Re-inserting at the same va doesn't add another entry.
+	assert(page_insert(pgdir[0], pp, (void *) UTEXT, PTE_U|PTE_W) == 0);
+	assert(rmap_count(pp) == nmaps);
+
+	// Unmap from the front, so holes are filled from the head node.
+	for (i = 0, n = nmaps; i < nmaps; i++) {
+		page_remove(pgdir[i % 2], (void *) check_rmap_va(i));
+		assert(rmap_count(pp) == --n);
+		assert(!rmap_chain(pp) == (n <= 2));
+	}
+	assert(!pp->pp_rmap[0] && !pp->pp_rmap[1]);
+	assert(pp->pp_ref == 1);
+	page_decref(pp);
+
+	for (i = 0; i < 2; i++) {
+		for (va = UTEXT; va <= check_rmap_va(nmaps - 1); va += PTSIZE)
+			if (pgdir[i][PDX(va)] & PTE_P) {
+				page_decref(pa2page(PTE_ADDR(pgdir[i][PDX(va)])));
+				pgdir[i][PDX(va)] = 0;
+			}
+		pgdir_free(pgdir[i]);
+	}
+	cprintf("check_rmap() succeeded!\n");
+}
@@ -0,0 +1,43 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_RMAP_H
+#define JOS_KERN_RMAP_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/memlayout.h>
+
+// The reverse map of a page lists every PTE that maps it.  The first
+// two PTEs are kept in the PageInfo's pp_rmap itself.  Once there are
+// more, pp_rmap[0] instead points, tagged with RMAP_CHAIN, to a chain
+// of RmapChain nodes holding all of them, and pp_rmap[1] is NULL.
+// Only the head node of a chain may have NULL slots, at its end.
+#define RMAP_CHAIN		0x1
+#define RMAP_CHAIN_NPTES	7
+
+struct RmapChain {
+	struct RmapChain *rc_next;
+	pte_t *rc_ptes[RMAP_CHAIN_NPTES];
+};
+
+// Iterates over the PTEs mapping a page, which must not be mapped or
+// unmapped until the iteration is over.
+struct RmapIter {
+	struct PageInfo *ri_page;
+	struct RmapChain *ri_chain;	// Node being walked, or NULL
+	int ri_index;			// Next slot to look at
+};
+
+void	rmap_init(void);
+int	rmap_add(struct PageInfo *pp, pte_t *pte);
+void	rmap_remove(struct PageInfo *pp, pte_t *pte);
+int	rmap_count(struct PageInfo *pp);
+
+void	rmap_iter_init(struct RmapIter *it, struct PageInfo *pp);
+pte_t	*rmap_iter_next(struct RmapIter *it);
+
+pde_t	*rmap_pgdir(pte_t *pte);
+uintptr_t rmap_va(pte_t *pte);
+
+#endif // !JOS_KERN_RMAP_H
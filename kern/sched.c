@@ -77,7 +77,10 @@ sched_halt(void)
 
 	// Mark that no environment is running on this CPU
 	curenv = NULL;
-	lcr3(PADDR(kern_pgdir));
+	pgdir_load(kern_pgdir);
+
+	// Use the idle time to refill the pre-zeroed page pool.
+	page_zero_idle();
 
 	// Mark that this CPU is in the HALT state, so that when
 	// timer interupts come in, we know we should re-acquire the
@@ -87,14 +90,17 @@ sched_halt(void)
 	// Release the big kernel lock as if we were "leaving" the kernel
 	unlock_kernel();
 
-	// Reset stack pointer, enable interrupts and then halt.
+	// Reset stack pointer, enable interrupts and then halt.  A TLB
+	// shootdown returns here, to halt again.
 	asm volatile (
 		"movl $0, %%ebp\n"
 		"movl %0, %%esp\n"
 		"pushl $0\n"
 		"pushl $0\n"
 		"sti\n"
+		"1:\n"
 		"hlt\n"
+		"jmp 1b\n"
 	: : "a" (thiscpu->cpu_ts.ts_esp0));
 }
 
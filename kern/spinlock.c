@@ -7,6 +7,7 @@
 #include <inc/string.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/tlb.h>
 #include <kern/kdebug.h>
 
 // The big kernel lock
@@ -79,6 +80,28 @@ spin_lock(struct spinlock *lk)
 #endif
 }
 
+// Try once to acquire the lock.
+// Returns 1 if it was acquired, 0 if another CPU holds it.
+bool
+spin_trylock(struct spinlock *lk)
+{
+#ifdef DEBUG_SPINLOCK
+	if (holding(lk))
+		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
+#endif
+
+	if (xchg(&lk->locked, 1) != 0) {
+		asm volatile ("pause");
+		return 0;
+	}
+
+#ifdef DEBUG_SPINLOCK
+	lk->cpu = thiscpu;
+	get_caller_pcs(lk->pcs);
+#endif
+	return 1;
+}
+
 // Release the lock.
 void
 spin_unlock(struct spinlock *lk)
@@ -119,3 +142,13 @@ spin_unlock(struct spinlock *lk)
 	// the above assignments (and after the critical section).
 	xchg(&lk->locked, 0);
 }
+
+// Acquire the big kernel lock.  The CPU holding it may be waiting for
+// this one to flush its TLB, and interrupts are off here, so answer
+// shootdowns while spinning.
+void
+lock_kernel(void)
+{
+	while (!spin_trylock(&kernel_lock))
+		tlb_shootdown_poll();
+}
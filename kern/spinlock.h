@@ -21,17 +21,14 @@ struct spinlock {
 
 void __spin_initlock(struct spinlock *lk, char *name);
 void spin_lock(struct spinlock *lk);
+bool spin_trylock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
 
 extern struct spinlock kernel_lock;
 
-static inline void
-lock_kernel(void)
-{
-	spin_lock(&kernel_lock);
-}
+void lock_kernel(void);
 
 static inline void
 unlock_kernel(void)
@@ -0,0 +1,351 @@
+/* See COPYRIGHT for copyright information. */
+
+/*
+ * Swapping user pages out to the second IDE disk.
+ *
+ * The disk is divided into page-sized slots.  Pages that compress well
+ * are kept compressed in memory instead (kern/zram.c), and only the
+ * rest is written to disk.  When the page allocator
+ * runs dry, swap_out picks a victim with the clock algorithm: a hand
+ * sweeps over the user address spaces, clearing PTE_A on pages that
+ * were used since it last passed and evicting the first one that was
+ * not.  Only pages mapped exactly once are evicted, so the victim's
+ * one PTE is all that needs to change, and merged pages (kern/ksm.c)
+ * are left in memory.  A later access faults, and
+ * page_fault_handler brings the page back with swap_in.
+ */
+
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/swap.h>
+#include <kern/ide.h>
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/kmalloc.h>
+#include <kern/zram.h>
+#include <kern/rmap.h>
+#include <kern/tlb.h>
+
+static uint32_t swap_nslots;	// 0 if there is no swap disk
+static uint32_t *swap_bitmap;	// Set bits are slots in use
+static uint32_t swap_hint;	// Where to start looking for a free slot
+
+// The clock hand: the next page swap_out looks at.
+static uint32_t clock_env;
+static uintptr_t clock_va;
+
+static void check_swap(void);
+
+void
+swap_init(void)
+{
+	zram_init();
+
+	// Slot numbers must leave SWAP_ZRAM clear.
+	swap_nslots = MIN(ide_probe(IDE_SWAPDISK) / BLKSECTS, SWAP_ZRAM);
+	if (!swap_nslots) {
+		cprintf("swap: no disk %d, compressed swap only\n", IDE_SWAPDISK);
+		check_swap();
+		return;
+	}
+
+	swap_bitmap = kmalloc(ROUNDUP(swap_nslots, 32) / 8);
+	if (!swap_bitmap)
+		panic("swap_init: out of memory");
+	memset(swap_bitmap, 0, ROUNDUP(swap_nslots, 32) / 8);
+	meminfo.mi_swap_total = swap_nslots;
+	cprintf("swap: %uK on disk %d\n", swap_nslots * (PGSIZE / 1024),
+		IDE_SWAPDISK);
+
+	check_swap();
+}
+
+static int
+swap_slot_alloc(void)
+{
+	uint32_t i, slot;
+
+	for (i = 0; i < swap_nslots; i++) {
+		slot = (swap_hint + i) % swap_nslots;
+		if (!(swap_bitmap[slot / 32] & (1 << (slot % 32)))) {
+			swap_bitmap[slot / 32] |= 1 << (slot % 32);
+			swap_hint = slot + 1;
+			meminfo_add(&meminfo.mi_swap_used, 1, NULL);
+			return slot;
+		}
+	}
+	return -E_NO_MEM;
+}
+
+static void
+swap_slot_free(uint32_t slot)
+{
+	assert(slot < swap_nslots);
+	assert(swap_bitmap[slot / 32] & (1 << (slot % 32)));
+	swap_bitmap[slot / 32] &= ~(1 << (slot % 32));
+	meminfo_add(&meminfo.mi_swap_used, -1, NULL);
+}
+
+//
+// Release the swap entry of a swapped-out PTE.  The caller clears the PTE.
+//
+void
+swap_free(pte_t pte)
+{
+	uint32_t entry;
+
+	assert(PTE_SWAPPED(pte));
+	entry = PTE_SWAPENTRY(pte);
+	if (entry & SWAP_ZRAM)
+		zram_free(entry & ~SWAP_ZRAM);
+	else
+		swap_slot_free(entry);
+}
+
+static int
+swap_page_io(struct PageInfo *pp, uint32_t slot, bool write)
+{
+	void *kva = kmap(pp);
+	int r;
+
+	if (write)
+		r = ide_write(IDE_SWAPDISK, slot * BLKSECTS, kva, BLKSECTS);
+	else
+		r = ide_read(IDE_SWAPDISK, slot * BLKSECTS, kva, BLKSECTS);
+	kunmap(kva);
+	return r;
+}
+
+//
+// Compress the page that *pte maps at va, or write it out to disk, and
+// leave the swap entry in *pte instead.
+//
+static int
+swap_out_page(pde_t *pgdir, void *va, pte_t *pte)
+{
+	struct PageInfo *pp = pa2page(PTE_ADDR(*pte));
+	uint32_t entry;
+	int r;
+
+	if ((r = zram_store(pp)) >= 0)
+		entry = r | SWAP_ZRAM;
+	else {
+		if ((r = swap_slot_alloc()) < 0)
+			return r;
+		entry = r;
+		if ((r = swap_page_io(pp, entry, 1)) < 0) {
+			swap_slot_free(entry);
+			return r;
+		}
+	}
+
+	rmap_remove(pp, pte);
+	*pte = SWAP_PTE(entry, *pte);
+	tlb_invalidate(pgdir, va);
+	page_decref(pp);
+	pa2page(PADDR(pgdir))->pp_nmapped--;
+	meminfo_add(&meminfo.mi_mapped, -1, NULL);
+	meminfo_add(&meminfo.mi_swap_outs, 1, NULL);
+	return 0;
+}
+
+// Whether the clock may look at e's pages.  Envs running on other CPUs
+// may have the PTEs cached in their TLBs, so they are left alone.
+static bool
+swap_env_ok(struct Env *e)
+{
+	return e->env_status != ENV_FREE && e->env_pgdir
+		&& (e == curenv || e->env_status != ENV_RUNNING);
+}
+
+//
+// Evict one user page to swap.
+// Returns 0 on success, -E_NO_MEM if there was nothing to evict or no
+// swap slot to put it in, or -E_IO on a disk error.
+//
+int
+swap_out(void)
+{
+	struct Env *e;
+	struct TlbBatch tb;
+	pte_t *pte;
+	uintptr_t va;
+	int nvisits, r = -E_NO_MEM;
+
+	// Two sweeps over every address space: the first one may do
+	// nothing but clear PTE_A bits.  Their invalidations are queued
+	// per address space.
+	tlb_batch_init(&tb, NULL);
+	for (nvisits = 0; nvisits <= 2 * NENV; ) {
+		e = &envs[clock_env];
+		if (clock_va >= UTOP || !swap_env_ok(e)) {
+			clock_env = (clock_env + 1) % NENV;
+			clock_va = 0;
+			nvisits++;
+			continue;
+		}
+		// Pages in a page table shared since sys_fork are mapped
+		// in several address spaces, whatever pp_ref says.
+		if (!(e->env_pgdir[PDX(clock_va)] & PTE_P)
+		    || pgdir_pt_shared(e->env_pgdir, (void *) clock_va)) {
+			clock_va = ROUNDUP(clock_va + 1, PTSIZE);
+			continue;
+		}
+
+		va = clock_va;
+		clock_va += PGSIZE;
+		pte = pgdir_walk(e->env_pgdir, (void *) va, 0);
+		if ((*pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U)
+		    || pa2page(PTE_ADDR(*pte))->pp_ref != 1
+		    || (pa2page(PTE_ADDR(*pte))->pp_flags & PP_KSM))
+			continue;
+		if (*pte & PTE_A) {
+			*pte &= ~PTE_A;
+			if (tb.tb_pgdir != e->env_pgdir) {
+				tlb_batch_flush(&tb);
+				tlb_batch_init(&tb, e->env_pgdir);
+			}
+			tlb_batch_add(&tb, (void *) va);
+			continue;
+		}
+		r = swap_out_page(e->env_pgdir, (void *) va, pte);
+		break;
+	}
+	tlb_batch_flush(&tb);
+	return r;
+}
+
+//
+// If the page at va in pgdir is swapped out, read it back in.
+// Returns 1 if it was, 0 if va was not swapped out, and < 0 on error.
+//
+int
+swap_in(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp;
+	uint32_t entry;
+	pte_t *pte;
+	int r;
+
+	pte = pgdir_walk(pgdir, va, 0);
+	if (!pte || !PTE_SWAPPED(*pte))
+		return 0;
+
+	if (!(pp = page_alloc_reclaim(ALLOC_HIGHMEM | alloc_color(pgdir, va))))
+		return -E_NO_MEM;
+	entry = PTE_SWAPENTRY(*pte);
+	if (entry & SWAP_ZRAM)
+		r = zram_load(entry & ~SWAP_ZRAM, pp);
+	else
+		r = swap_page_io(pp, entry, 0);
+	if (r < 0) {
+		page_free(pp);
+		return r;
+	}
+
+	// page_insert releases the slot along with the old PTE.  The page
+	// starts out accessed, so the clock won't pick it right away.
+	r = page_insert(pgdir, pp, ROUNDDOWN(va, PGSIZE),
+			(*pte & (PTE_SYSCALL & ~PTE_P)) | PTE_A);
+	assert(r == 0);
+	meminfo_add(&meminfo.mi_swap_ins, 1, NULL);
+	return 1;
+}
+
+//
+// Like page_alloc, but if memory is short, swap user pages out until
+// the allocation succeeds, unless (alloc_flags & ALLOC_NORECLAIM).
+// The caller must not hold a page it looked up but has not mapped yet:
+// it may be the one evicted.
+//
+struct PageInfo *
+page_alloc_reclaim(int alloc_flags)
+{
+	struct PageInfo *pp;
+
+	while (!(pp = page_alloc(alloc_flags)))
+		if ((alloc_flags & ALLOC_NORECLAIM) || swap_out() < 0)
+			return NULL;
+	return pp;
+}
+
+// Push a page filled by fill() out to swap and back in, in a scratch
+// address space, and check that it went to zram or not as expected.
+static void
+check_swap_page(uint32_t (*fill)(int), bool zram)
+{
+	struct PageInfo *pp;
+	pde_t *pgdir;
+	pte_t *pte;
+	uint32_t *p, used, stored;
+	void *va = (void *) UTEXT;
+	int i;
+
+	used = meminfo.mi_swap_used;
+	stored = meminfo.mi_zram_stored;
+	assert((pgdir = pgdir_alloc()));
+	assert((pp = page_alloc(ALLOC_HIGHMEM)));
+	p = kmap(pp);
+	for (i = 0; i < PGSIZE / 4; i++)
+		p[i] = fill(i);
+	kunmap(p);
+	assert(page_insert(pgdir, pp, va, PTE_U|PTE_W|PTE_AVAIL) == 0);
+	pte = pgdir_walk(pgdir, va, 0);
+
+	// out: the page is freed and the PTE remembers the entry and perms
+	assert(swap_out_page(pgdir, va, pte) == 0);
+	assert(PTE_SWAPPED(*pte));
+	assert(!(PTE_SWAPENTRY(*pte) & SWAP_ZRAM) == !zram);
+	assert((*pte & PTE_SYSCALL) == (PTE_U|PTE_W|PTE_AVAIL));
+	assert(pgdir_nmapped(pgdir) == 0);
+	assert(meminfo.mi_swap_used == used + !zram);
+	assert(meminfo.mi_zram_stored == stored + zram);
+	assert(page_lookup(pgdir, va, NULL) == NULL);
+
+	// in: same contents and perms, entry released
+	assert(swap_in(pgdir, va) == 1);
+	assert(swap_in(pgdir, va) == 0);
+	assert((*pte & PTE_SYSCALL) == (PTE_P|PTE_U|PTE_W|PTE_AVAIL));
+	assert(pgdir_nmapped(pgdir) == 1);
+	assert(meminfo.mi_swap_used == used);
+	assert(meminfo.mi_zram_stored == stored);
+	pp = page_lookup(pgdir, va, NULL);
+	assert(pp && pp->pp_ref == 1);
+	p = kmap(pp);
+	for (i = 0; i < PGSIZE / 4; i++)
+		assert(p[i] == fill(i));
+	kunmap(p);
+
+	// unmapping a swapped-out page releases its entry, and the page
+	// table it leaves empty
+	assert(swap_out_page(pgdir, va, pte) == 0);
+	page_remove(pgdir, va);
+	assert(!(pgdir[PDX(va)] & PTE_P));
+	assert(meminfo.mi_swap_used == used);
+	assert(meminfo.mi_zram_stored == stored);
+
+	pgdir_free(pgdir);
+}
+
+static uint32_t
+check_fill_random(int i)
+{
+	return i * 2654435761U;
+}
+
+static uint32_t
+check_fill_text(int i)
+{
+	return i % 16 == 0 ? i : 0x656e6f6a;
+}
+
+static void
+check_swap(void)
+{
+	check_swap_page(check_fill_text, 1);
+	if (swap_nslots)
+		check_swap_page(check_fill_random, 0);
+	cprintf("check_swap() succeeded!\n");
+}
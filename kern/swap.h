@@ -0,0 +1,28 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SWAP_H
+#define JOS_KERN_SWAP_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/memlayout.h>
+
+// The PTE of a swapped-out user page has PTE_P clear, keeps the other
+// permission bits, and holds its swap entry plus one (so that it is
+// never 0) in the address bits.  A swap entry is a slot on the swap
+// disk, or, with SWAP_ZRAM set, a handle in the compressed tier.
+#define SWAP_ZRAM		0x80000
+#define PTE_SWAPPED(pte)	(!((pte) & PTE_P) && PTE_ADDR(pte))
+#define PTE_SWAPENTRY(pte)	((uint32_t) (PTE_ADDR(pte) >> PGSHIFT) - 1)
+#define SWAP_PTE(entry, pte)	\
+	((((pte_t) (entry) + 1) << PGSHIFT) | ((pte) & (PTE_SYSCALL & ~PTE_P)))
+
+void	swap_init(void);
+int	swap_out(void);
+int	swap_in(pde_t *pgdir, void *va);
+void	swap_free(pte_t pte);
+
+struct PageInfo *page_alloc_reclaim(int alloc_flags);
+
+#endif // !JOS_KERN_SWAP_H
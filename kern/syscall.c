@@ -11,6 +11,11 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/swap.h>
+#include <kern/zeropage.h>
+#include <kern/ksm.h>
+#include <kern/tlb.h>
+#include <kern/uaccess.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -22,46 +27,23 @@ sys_cputs(const char *s, size_t len)
 	// Destroy the environment if not.
 
 	// LAB 3: Your code here.
-	uintptr_t start = (uintptr_t) ROUNDDOWN(s, PGSIZE);
-	uintptr_t end = (uintptr_t) ROUNDUP(s+len, PGSIZE);
-	uintptr_t iter;
-	int die = 0;
-	for (iter=start; iter<end; iter+=PGSIZE)
-	{
-		int non_create = 0;
-		pte_t * ppte = pgdir_walk(curenv->env_pgdir, (void*) iter, non_create);
-		if (!ppte)
-		{ //secondary page table not present or page not present.
-			die = 1;
-			break;
-		}
-		else if (!PAGE_PRESENT(*ppte))
-		{
-			die = 2;
-			break;
-		}
-		else if (iter > ULIM)
-		{ // 越界了
-			die = 3;
-			break;
-		}
-		else if ((*ppte & PTE_U) == 0)
-		{ // no user permission.
-			die = 4;
-			break;
+	// Copy and print a piece at a time, never crossing a page, so that
+	// a fault is reported at the first byte of the page it is on.
+	char buf[128];
+	size_t n;
+
+	for (; len; s += n, len -= n) {
+		n = MIN(MIN(len, sizeof(buf)), PGSIZE - PGOFF(s));
+		if (copy_from_user(buf, s, n) < 0) {
+			cprintf("[%08x] user_mem_check assertion failure for va %08x\n",
+				curenv->env_id, s);
+			env_destroy(curenv);	// may not return
+			return;
 		}
-	}
-	if (die)
-	{
-		cprintf("Memory fault #%d, s is %p, len is %x\n", die, s, len);
-		cprintf("[%08x] user_mem_check assertion failure for va %08x\n", curenv->env_id, iter+((uintptr_t)s-start));
-		env_destroy(curenv);
-		// maybe sys_yield() later.
-		// fixme: no else clause.
-	}
 
-	// Print the string supplied by the user.
-	cprintf("%.*s", len, s);
+		// Print the string supplied by the user.
+		cprintf("%.*s", n, buf);
+	}
 }
 
 // Read a character from the system console without blocking.
@@ -134,6 +116,112 @@ sys_exofork(void)
 	return pEnv->env_id;
 }
 
+// Give the child address space cpgdir the parent's user page at va,
+// whose PTE in pgdir is pte.  A writable page becomes copy-on-write in
+// both, with the parent's stale TLB entry queued in tb.
+static int
+fork_page(pde_t *pgdir, pde_t *cpgdir, void *va, pte_t *pte,
+	  struct TlbBatch *tb)
+{
+	int perm, r;
+
+	if (PTE_SWAPPED(*pte) && (r = swap_in(pgdir, va)) < 0)
+		return r;
+	if (PTE_DEMAND_ZERO(*pte))
+		// Nothing to share yet: the child gets its own zero fill.
+		return zero_page_reserve(cpgdir, va, *pte & PTE_SYSCALL);
+
+	perm = *pte & PTE_SYSCALL;
+	if (perm & PTE_W) {
+		perm = (perm & ~PTE_W) | PTE_COW;
+		*pte = (*pte & ~PTE_W) | PTE_COW;
+		tlb_batch_add(tb, va);
+	}
+	return page_insert(cpgdir, pa2page(PTE_ADDR(*pte)), va, perm);
+}
+
+// Create a child environment that is a copy-on-write clone of the
+// current one, and make it runnable.
+//
+// The child gets the parent's registers, tweaked so sys_fork returns 0
+// in it, and every user page the parent has.  The parent's page
+// directory is walked once, skipping the page tables it does not have.
+// Most page tables are shared whole, write-protected, until either
+// side changes or writes to the region (see pgdir_share_pt).  The PTEs
+// of the others, the stacks' and those with pages swapped out, are
+// copied, with writable pages mapped PTE_COW in both address spaces
+// and other pages shared as they are.  The exception stack is not
+// shared: if the parent has a page fault upcall, the child gets the
+// same upcall and a fresh exception stack before it can run.
+//
+// Returns envid of the child, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+	struct Env *e;
+	struct PageInfo *pp;
+	struct TlbBatch tb;
+	pde_t *pgdir = curenv->env_pgdir;
+	pte_t *pt;
+	uint32_t pdeno, pteno;
+	void *va;
+	int r;
+
+	if ((r = env_alloc(&e, curenv->env_id)) < 0)
+		return r;
+	e->env_status = ENV_NOT_RUNNABLE;
+	e->env_tf = curenv->env_tf;
+	e->env_tf.tf_regs.reg_eax = 0;
+
+	tlb_batch_init(&tb, pgdir);
+	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+		if (!(pgdir[pdeno] & PTE_P))
+			continue;
+		va = PGADDR(pdeno, 0, 0);
+		// Share whole page tables, but not the exception stack's.
+		if (pdeno != PDX(UXSTACKTOP - PGSIZE)
+		    && pgdir_share_pt(pgdir, e->env_pgdir, va) == 0) {
+			tlb_batch_add_range(&tb, va, NPTENTRIES);
+			continue;
+		}
+		if ((r = pgdir_unshare_pt(pgdir, va)) < 0)
+			goto fail;
+		pt = (pte_t *) KADDR(PTE_ADDR(pgdir[pdeno]));
+		for (pteno = 0; pteno <= PTX(~0); pteno++) {
+			va = PGADDR(pdeno, pteno, 0);
+			if (!pt[pteno] || va == (void *) (UXSTACKTOP - PGSIZE))
+				continue;
+			if ((r = fork_page(pgdir, e->env_pgdir, va, &pt[pteno], &tb)) < 0)
+				goto fail;
+		}
+	}
+	tlb_batch_flush(&tb);
+
+	e->env_fault_around = curenv->env_fault_around;
+	if ((e->env_pgfault_upcall = curenv->env_pgfault_upcall)) {
+		va = (void *) (UXSTACKTOP - PGSIZE);
+		r = -E_NO_MEM;
+		if (!(pp = page_alloc_reclaim(ALLOC_ZERO | ALLOC_HIGHMEM
+					      | alloc_color(e->env_pgdir, va))))
+			goto fail;
+		if ((r = page_insert(e->env_pgdir, pp, va, PTE_P|PTE_U|PTE_W)) < 0) {
+			page_free(pp);
+			goto fail;
+		}
+	}
+
+	e->env_status = ENV_RUNNABLE;
+	return e->env_id;
+
+fail:
+	// The parent's pages stay copy-on-write, which only costs a copy.
+	tlb_batch_flush(&tb);
+	env_free(e);
+	return r;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -225,16 +313,40 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 		return -E_INVAL;
 	if ((!(perm&PTE_U)) || !(perm&PTE_P) || (perm&~PTE_U&~PTE_P&~PTE_AVAIL&~PTE_W))
 		return -E_INVAL;
-	struct PageInfo * ppi = page_alloc(ALLOC_ZERO);
+	// Swap other pages out rather than fail, if there is swap space.
+	struct PageInfo * ppi = page_alloc_reclaim(ALLOC_ZERO | ALLOC_HIGHMEM
+						   | alloc_color(pe->env_pgdir, va));
 	if (!ppi)
 		return -E_NO_MEM;
 
-	if ((r = page_insert(pe->env_pgdir, ppi, va, perm | PTE_U | PTE_P)))
-		return r;
+	while ((r = page_insert(pe->env_pgdir, ppi, va, perm | PTE_U | PTE_P)))
+		if (swap_out() < 0) {
+			page_free(ppi);
+			return r;
+		}
 
 	return 0;
 }
 
+// Like sys_page_alloc, but the page is only allocated when it is
+// first written to.  Until then, reads see the shared zero page.
+//
+// Return 0 on success, < 0 on error.  Errors are as for sys_page_alloc.
+static int
+sys_page_reserve(envid_t envid, void *va, int perm)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	if (ROUNDDOWN(va, PGSIZE) != va || va >= (void *) UTOP)
+		return -E_INVAL;
+	if (!(perm & PTE_U) || !(perm & PTE_P) || (perm & ~PTE_SYSCALL))
+		return -E_INVAL;
+	return zero_page_reserve(e->env_pgdir, va, perm);
+}
+
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
@@ -277,6 +389,8 @@ sys_page_map(envid_t srcenvid, void *srcva,
 		return -E_BAD_ENV;
 	pte_t *ppte;
 	struct PageInfo *ppi;
+	if ((r = user_page_prepare(srcenv->env_pgdir, srcva, perm & PTE_W)) < 0)
+		return r;
 	ppi = page_lookup(srcenv->env_pgdir, srcva, &ppte);
 	if ((ppi == NULL) || ((perm & PTE_W) != 0 && (*ppte & PTE_W) == 0))
 		return -E_INVAL;
@@ -292,6 +406,8 @@ sys_page_map(envid_t srcenvid, void *srcva,
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_NO_MEM if the page table is shared since sys_fork, and there's
+//		no memory to copy it.
 static int
 sys_page_unmap(envid_t envid, void *va)
 {
@@ -304,10 +420,174 @@ sys_page_unmap(envid_t envid, void *va)
 	int r;
 	if ((r = envid2env (envid, &pe, 1)) < 0)
 		return -E_BAD_ENV;
+	if ((r = pgdir_unshare_pt(pe->env_pgdir, va)) < 0)
+		return r;
 	page_remove(pe->env_pgdir, va);
 	return 0;
 }
 
+// Check that the npages pages from va are a page-aligned range below UTOP.
+static int
+check_user_range(void *va, size_t npages)
+{
+	if (ROUNDDOWN(va, PGSIZE) != va || va >= (void *) UTOP
+	    || npages > (UTOP - (uintptr_t) va) / PGSIZE)
+		return -E_INVAL;
+	return 0;
+}
+
+// Like sys_page_alloc, for the npages pages from va.
+//
+// Return the number of pages allocated and mapped, which is less than
+// npages if memory ran out partway.  Return < 0 on error, or if memory
+// ran out at the first page.  Errors are:
+//	-E_BAD_ENV, -E_INVAL as for sys_page_alloc, or if the range
+//		goes past UTOP.
+//	-E_NO_MEM if there's no memory for the first page or page table.
+static int
+sys_page_alloc_range(envid_t envid, void *va, size_t npages, int perm)
+{
+	struct Env *e;
+	struct PageInfo *pp;
+	struct PtIter it;
+	uintptr_t pva;
+	pte_t *pte;
+	size_t i;
+	int r;
+
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	if ((r = check_user_range(va, npages)) < 0)
+		return r;
+	if (!(perm & PTE_U) || !(perm & PTE_P) || (perm & ~PTE_SYSCALL))
+		return -E_INVAL;
+
+	pt_iter_init(&it, e->env_pgdir, va, npages);
+	for (i = 0; i < npages; i++, va += PGSIZE) {
+		if (!(pp = page_alloc_reclaim(ALLOC_ZERO | ALLOC_HIGHMEM
+					      | alloc_color(e->env_pgdir, va)))) {
+			r = -E_NO_MEM;
+			break;
+		}
+		// Only look up the PTE now: reclaiming may have copied
+		// the page table.
+		if (!(pte = pt_iter_next(&it, &pva, PT_ITER_CREATE))) {
+			page_free(pp);
+			r = -E_NO_MEM;
+			break;
+		}
+		while ((r = page_insert_pte(e->env_pgdir, pte, pp, va, perm)) < 0
+		       && swap_out() >= 0)
+			/* try again */;
+		if (r < 0) {
+			page_free(pp);
+			break;
+		}
+	}
+	return i ? i : r;
+}
+
+// Like sys_page_map, for the npages pages from srcva and dstva.
+// A system call only has five arguments, so npages_perm holds npages
+// shifted left by PGSHIFT, and perm in the bits below.
+//
+// Return the number of pages mapped, which is less than npages if a
+// page could not be mapped.  Return < 0 on error, or if the first page
+// could not be mapped.  Errors are as for sys_page_map, and:
+//	-E_INVAL if either range is not page-aligned or goes past UTOP.
+static int
+sys_page_map_range(envid_t srcenvid, void *srcva,
+		   envid_t dstenvid, void *dstva, uint32_t npages_perm)
+{
+	struct Env *srcenv, *dstenv;
+	struct PageInfo *pp;
+	struct PtIter src, dst;
+	uintptr_t sva, dva;
+	pte_t *pte;
+	size_t npages = npages_perm >> PGSHIFT;
+	int perm = PGOFF(npages_perm);
+	size_t i;
+	int r = 0;
+
+	if ((r = envid2env(srcenvid, &srcenv, 1)) < 0
+	    || (r = envid2env(dstenvid, &dstenv, 1)) < 0)
+		return r;
+	if ((r = check_user_range(srcva, npages)) < 0
+	    || (r = check_user_range(dstva, npages)) < 0)
+		return r;
+	if (!(perm & PTE_U) || !(perm & PTE_P) || (perm & ~PTE_SYSCALL))
+		return -E_INVAL;
+
+	pt_iter_init(&src, srcenv->env_pgdir, srcva, npages);
+	pt_iter_init(&dst, dstenv->env_pgdir, dstva, npages);
+	for (i = 0; i < npages; i++) {
+		if (!(pte = pt_iter_next(&src, &sva, 0))) {
+			r = -E_INVAL;
+			break;
+		}
+		// Pages already mapped as asked need no preparing.
+		if (!(*pte & PTE_P)
+		    || ((perm & PTE_W) && (!(*pte & PTE_W)
+					   || pgdir_pt_shared(srcenv->env_pgdir, (void *) sva)))) {
+			if ((r = user_page_prepare(srcenv->env_pgdir, (void *) sva,
+						   perm & PTE_W)) < 0)
+				break;
+			pte = pgdir_walk(srcenv->env_pgdir, (void *) sva, 0);
+		}
+		if (!(*pte & PTE_P) || ((perm & PTE_W) && !(*pte & PTE_W))) {
+			r = -E_INVAL;
+			break;
+		}
+		// Take the page before the destination's page table is
+		// looked up, which may copy the source's.
+		pp = pa2page(PTE_ADDR(*pte));
+		if (!(pte = pt_iter_next(&dst, &dva, PT_ITER_CREATE))) {
+			r = -E_NO_MEM;
+			break;
+		}
+		if ((r = page_insert_pte(dstenv->env_pgdir, pte, pp, (void *) dva, perm)) < 0)
+			break;
+	}
+	return i ? i : r;
+}
+
+// Like sys_page_unmap, for the npages pages from va.  Page tables that
+// aren't there are skipped whole, and the TLB is flushed in batches.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV, -E_NO_MEM as for sys_page_unmap.
+//	-E_INVAL if the range is not page-aligned or goes past UTOP.
+static int
+sys_page_unmap_range(envid_t envid, void *va, size_t npages)
+{
+	struct Env *e;
+	struct TlbBatch tb;
+	struct PtIter it;
+	uintptr_t pva;
+	pte_t *pte;
+	int r;
+
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	if ((r = check_user_range(va, npages)) < 0)
+		return r;
+
+	tlb_batch_init(&tb, e->env_pgdir);
+	pt_iter_init(&it, e->env_pgdir, va, npages);
+	while ((pte = pt_iter_next(&it, &pva, PT_ITER_SKIP))) {
+		if (!*pte)
+			continue;
+		if (pgdir_pt_shared(e->env_pgdir, (void *) pva)) {
+			if ((r = pgdir_unshare_pt(e->env_pgdir, (void *) pva)) < 0)
+				break;
+			pte = pgdir_walk(e->env_pgdir, (void *) pva, 0);
+		}
+		page_remove_pte(e->env_pgdir, (void *) pva, pte, &tb);
+	}
+	tlb_batch_flush(&tb);
+	return r;
+}
+
 static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
@@ -330,6 +610,9 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 	pte_t *pte;
 	struct PageInfo *pp;
 // if srcva < UTOP but srcva is not mapped in the caller's address space.
+		if (srcva < (void *)UTOP
+		    && (r = user_page_prepare(curenv->env_pgdir, srcva, perm & PTE_W)) < 0)
+			return r;
 		if (srcva < (void *)UTOP && (pp = page_lookup (curenv->env_pgdir, srcva, &pte)) == NULL)
 			return -E_INVAL;
 // if (perm & PTE_W), but srcva is read-only in the current environment's address space.
@@ -379,6 +662,53 @@ sys_ipc_recv(void *dstva)
 	return 0;
 }
 
+// Copy the physical memory statistics to 'info', with mi_env_resident
+// set to the number of pages mapped in environment envid, and
+// mi_env_faults and mi_env_faults_around to its page fault counts.
+// The counters are kept up to date by kern/pmap.c, so this is O(1).
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//	-E_FAULT if 'info' is not writable by the environment.
+static int
+sys_meminfo(envid_t envid, struct MemInfo *info)
+{
+	struct Env *e;
+	struct MemInfo mi;
+	int r;
+
+	if ((r = envid2env(envid, &e, 0)) < 0)
+		return r;
+	meminfo_read(&mi, e->env_pgdir);
+	mi.mi_env_faults = e->env_pgfaults;
+	mi.mi_env_faults_around = e->env_pgfaults_around;
+	return copy_to_user(info, &mi, sizeof(mi));
+}
+
+// Let each copy-on-write or demand-zero page fault of environment envid
+// also resolve the pages around it that are in the same state, up to
+// npages in all: those in the aligned block of npages pages that holds
+// the faulting page, and in the same page table.  npages 0 or 1 turns
+// this off.  Children made by sys_fork inherit the setting.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if npages is greater than FAULT_AROUND_MAX.
+static int
+sys_env_set_fault_around(envid_t envid, size_t npages)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+	if (npages > FAULT_AROUND_MAX)
+		return -E_INVAL;
+	e->env_fault_around = npages;
+	return 0;
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -407,18 +737,33 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	  case SYS_exofork:
 	  	  ret = sys_exofork();
 	  	  break;
+	  case SYS_fork:
+	  	  ret = sys_fork();
+	  	  break;
 	  case SYS_env_set_status:
 	  	  ret = sys_env_set_status((envid_t)a1, a2);
 	  	  break;
 	  case SYS_page_alloc:
 	  	  ret = sys_page_alloc((envid_t)a1, (void *)a2, a3);
 	  	  break;
+	  case SYS_page_reserve:
+	  	  ret = sys_page_reserve((envid_t)a1, (void *)a2, a3);
+	  	  break;
 	  case SYS_page_map:
 	  	  ret = sys_page_map((envid_t)a1, (void *)a2, (envid_t)a3, (void *)a4, a5);
 	  	  break;
 	  case SYS_page_unmap:
 	  	  ret = sys_page_unmap((envid_t)a1, (void *)a2);
 	  	  break;
+	  case SYS_page_alloc_range:
+	  	  ret = sys_page_alloc_range((envid_t)a1, (void *)a2, a3, a4);
+	  	  break;
+	  case SYS_page_map_range:
+	  	  ret = sys_page_map_range((envid_t)a1, (void *)a2, (envid_t)a3, (void *)a4, a5);
+	  	  break;
+	  case SYS_page_unmap_range:
+	  	  ret = sys_page_unmap_range((envid_t)a1, (void *)a2, a3);
+	  	  break;
 	  case SYS_env_set_pgfault_upcall:
 	  	  ret = sys_env_set_pgfault_upcall((envid_t)a1, (void *)a2);
 	  	  break;
@@ -428,6 +773,12 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	  case SYS_ipc_try_send:
 	  	  ret = sys_ipc_try_send((envid_t)a1, (uint32_t)a2, (void *)a3, (unsigned)a4);
 	  	  break;
+	  case SYS_meminfo:
+	  	  ret = sys_meminfo((envid_t)a1, (struct MemInfo *)a2);
+	  	  break;
+	  case SYS_env_set_fault_around:
+	  	  ret = sys_env_set_fault_around((envid_t)a1, (size_t)a2);
+	  	  break;
 	  // case SYS_env_set_trapframe:
 	  // 	  ret = sys_env_set_trapframe((envid_t)a1, (struct Trapframe *)a2);
 	  // 	  break;
@@ -0,0 +1,149 @@
+/* See COPYRIGHT for copyright information. */
+
+/*
+ * TLB shootdown.
+ *
+ * A page table change has to reach the TLB of every CPU that may cache
+ * the old entry: the CPUs that have the page directory loaded (see
+ * pgdir_load), or every CPU for kern_pgdir, whose mappings above UTOP
+ * are part of all address spaces.  Invalidations are queued in a
+ * TlbBatch, and flushing the batch sends one IPI to each of those
+ * CPUs and waits until all of them have carried it out.
+ *
+ * Senders hold the big kernel lock, so there is one shootdown in
+ * flight at most.  A target that is spinning for the kernel lock has
+ * interrupts disabled and cannot take the IPI; lock_kernel polls for
+ * a pending shootdown instead.
+ */
+
+#include <inc/x86.h>
+#include <inc/trap.h>
+#include <inc/assert.h>
+
+#include <kern/tlb.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+
+// The batch being shot down, and the CPUs that have yet to carry it out.
+static struct TlbBatch *volatile tlb_shootdown_batch;
+static volatile bool tlb_shootdown_pending[NCPU];
+
+void
+tlb_batch_init(struct TlbBatch *tb, pde_t *pgdir)
+{
+	tb->tb_pgdir = pgdir;
+	tb->tb_n = 0;
+	tb->tb_npages = 0;
+}
+
+//
+// Queue an invalidation of the page at va in tb's page directory.
+//
+void
+tlb_batch_add(struct TlbBatch *tb, void *va)
+{
+	if (tb->tb_n < TLB_BATCH_MAX)
+		tb->tb_va[tb->tb_n] = (uintptr_t) va;
+	if (tb->tb_n <= TLB_BATCH_MAX)
+		tb->tb_n++;
+}
+
+//
+// Queue an invalidation of the npages pages from va.
+//
+void
+tlb_batch_add_range(struct TlbBatch *tb, void *va, size_t npages)
+{
+	if (npages > TLB_BATCH_MAX)
+		tb->tb_n = TLB_BATCH_MAX + 1;
+	for (; npages > 0 && tb->tb_n <= TLB_BATCH_MAX; npages--, va += PGSIZE)
+		tlb_batch_add(tb, va);
+}
+
+//
+// Queue an invalidation of the page at va, which mapped pp until now,
+// and drop that mapping's reference to pp once it is carried out.
+//
+void
+tlb_batch_add_page(struct TlbBatch *tb, void *va, struct PageInfo *pp)
+{
+	if (tb->tb_npages == TLB_BATCH_PAGES)
+		tlb_batch_flush(tb);
+	tlb_batch_add(tb, va);
+	tb->tb_pages[tb->tb_npages++] = pp;
+}
+
+// Carry out tb on this CPU.
+static void
+tlb_batch_run(struct TlbBatch *tb)
+{
+	int i;
+
+	if (tb->tb_n <= TLB_BATCH_MAX)
+		for (i = 0; i < tb->tb_n; i++)
+			invlpg((void *) tb->tb_va[i]);
+	else if (tb->tb_pgdir == kern_pgdir)
+		tlb_flush_all();
+	else
+		// User mappings are not global: reloading cr3 drops them.
+		lcr3(rcr3());
+}
+
+// Whether the CPU c may cache mappings of tb's page directory.
+static bool
+tlb_batch_target(struct TlbBatch *tb, struct CpuInfo *c)
+{
+	if (tb->tb_pgdir == kern_pgdir)
+		return c->cpu_status != CPU_UNUSED;
+	return c->cpu_pgdir == tb->tb_pgdir;
+}
+
+//
+// Carry out the invalidations queued in tb on every CPU that may cache
+// them, release its pages, and empty tb.  The caller must hold the
+// kernel lock.
+//
+void
+tlb_batch_flush(struct TlbBatch *tb)
+{
+	struct CpuInfo *c, *me = thiscpu;
+	int i;
+
+	if (!tb->tb_n)
+		return;
+	// kern_pgdir is used before mp_init marks this CPU started.
+	if (tb->tb_pgdir == kern_pgdir || me->cpu_pgdir == tb->tb_pgdir)
+		tlb_batch_run(tb);
+
+	tlb_shootdown_batch = tb;
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c != me && tlb_batch_target(tb, c)) {
+			tlb_shootdown_pending[c - cpus] = 1;
+			lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_TLB);
+		}
+	for (c = cpus; c < cpus + ncpu; c++)
+		while (tlb_shootdown_pending[c - cpus])
+			asm volatile("pause");
+	tlb_shootdown_batch = NULL;
+
+	for (i = 0; i < tb->tb_npages; i++)
+		page_decref(tb->tb_pages[i]);
+	tb->tb_n = 0;
+	tb->tb_npages = 0;
+}
+
+//
+// Carry out the shootdown waiting for this CPU, if there is one.
+// Called on the IPI, and wherever a CPU waits with interrupts off:
+// spinning for the kernel lock, or setting up pages[] in mp_main.
+//
+void
+tlb_shootdown_poll(void)
+{
+	int cpu = cpunum();
+
+	if (!tlb_shootdown_pending[cpu])
+		return;
+	tlb_batch_run(tlb_shootdown_batch);
+	tlb_shootdown_pending[cpu] = 0;
+}
@@ -0,0 +1,36 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_TLB_H
+#define JOS_KERN_TLB_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/memlayout.h>
+
+// Pages a batch invalidates one by one; a batch with more pages than
+// this flushes the whole TLB instead.
+#define TLB_BATCH_MAX	16
+// Unmapped pages a batch holds on to until it is flushed.
+#define TLB_BATCH_PAGES	64
+
+// TLB invalidations queued for one page directory, to be carried out
+// on every CPU that may cache its mappings with a single IPI each.
+// Pages unmapped in the batch are only released after the flush, as
+// until then some TLB may still map them.
+struct TlbBatch {
+	pde_t *tb_pgdir;
+	int tb_n;			// Pages queued; > TLB_BATCH_MAX: flush all
+	uintptr_t tb_va[TLB_BATCH_MAX];
+	int tb_npages;
+	struct PageInfo *tb_pages[TLB_BATCH_PAGES];
+};
+
+void	tlb_batch_init(struct TlbBatch *tb, pde_t *pgdir);
+void	tlb_batch_add(struct TlbBatch *tb, void *va);
+void	tlb_batch_add_range(struct TlbBatch *tb, void *va, size_t npages);
+void	tlb_batch_add_page(struct TlbBatch *tb, void *va, struct PageInfo *pp);
+void	tlb_batch_flush(struct TlbBatch *tb);
+void	tlb_shootdown_poll(void);
+
+#endif // !JOS_KERN_TLB_H
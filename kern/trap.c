@@ -15,6 +15,11 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
+#include <kern/swap.h>
+#include <kern/ksm.h>
+#include <kern/zeropage.h>
+#include <kern/uaccess.h>
+#include <kern/tlb.h>
 
 #define LOCK_CODE
 
@@ -66,6 +71,8 @@ static const char *trapname(int trapno)
 		return "System call";
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return "Hardware Interrupt";
+	if (trapno == IRQ_OFFSET + IRQ_TLB)
+		return "TLB Shootdown";
 	return "(unknown trap)";
 }
 
@@ -111,6 +118,7 @@ trap_init(void)
 	extern void irq12_entry();
 	extern void irq13_entry();
 	extern void irq14_entry();
+	extern void irq_tlb_entry();
 
 
 	SETGATE(idt[T_DIVIDE], 0, GD_KT, divzero_entry, 0);
@@ -149,6 +157,7 @@ trap_init(void)
 	SETGATE(idt[IRQ_OFFSET+12], 0, GD_KT, irq12_entry, 0);
 	SETGATE(idt[IRQ_OFFSET+13], 0, GD_KT, irq13_entry, 0);
 	SETGATE(idt[IRQ_OFFSET+14], 0, GD_KT, irq14_entry, 0);
+	SETGATE(idt[IRQ_OFFSET+IRQ_TLB], 0, GD_KT, irq_tlb_entry, 0);
 	// Per-CPU setup
 	trap_init_percpu();
 }
@@ -300,6 +309,8 @@ trap_dispatch(struct Trapframe *tf)
 	  case IRQ_OFFSET:
 		  // clock interrupt
 		  lapic_eoi(); //lapic_eoi???? 这玩意好高级。
+		  page_zero_tick();
+		  ksm_tick();
 		  sched_yield();
 		  break;
 	  case IRQ_OFFSET + 1:
@@ -351,6 +362,15 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
+	// The CPU that sent a TLB shootdown holds the kernel lock and
+	// waits for us, so answer it right away and go back to whatever
+	// was interrupted, a user environment or a halted CPU.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB) {
+		tlb_shootdown_poll();
+		lapic_eoi();
+		return;
+	}
+
 	// Re-acqurie the big kernel lock if we were halted in
 	// sched_yield()
 	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
@@ -393,6 +413,11 @@ trap(struct Trapframe *tf)
 	// Dispatch based on what type of trap occurred
 	trap_dispatch(tf);
 
+	// A page fault the kernel took on user memory was dealt with by
+	// page_fault_handler: go back to the kernel code that took it.
+	if ((tf->tf_cs & 3) == 0 && tf->tf_trapno == T_PGFLT)
+		return;
+
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
 	// if doing so makes sense.
@@ -403,28 +428,130 @@ trap(struct Trapframe *tf)
 }
 
 
+//
+// After a demand-zero fault (zero set) or a copy-on-write fault at
+// fault_va in e, resolve the pages around it in e's fault-around
+// window that are in the same state, as if they had faulted the same
+// way.  The window is the aligned block of env_fault_around pages that
+// holds fault_va, cut down to its page table.  No memory is reclaimed
+// for the neighbours: once free pages run out, the rest are left to
+// fault on their own.
+//
+static void
+fault_around(struct Env *e, uintptr_t fault_va, bool write, bool zero)
+{
+	struct TlbBatch tb;
+	struct PtIter it;
+	uintptr_t start, end, va, pt_va;
+	pte_t *pte;
+	int r;
+
+	if (e->env_fault_around <= 1)
+		return;
+	fault_va = ROUNDDOWN(fault_va, PGSIZE);
+	pt_va = ROUNDDOWN(fault_va, PTSIZE);
+	start = fault_va - PGNUM(fault_va) % e->env_fault_around * PGSIZE;
+	end = start + e->env_fault_around * PGSIZE;
+	start = MAX(start, pt_va);
+	end = MIN(MIN(end, pt_va + PTSIZE), UTOP);
+
+	tlb_batch_init(&tb, e->env_pgdir);
+	pt_iter_init(&it, e->env_pgdir, (void *) start, (end - start) / PGSIZE);
+	while ((pte = pt_iter_next(&it, &va, 0))) {
+		if (zero && (PTE_DEMAND_ZERO(*pte)
+			     || (write && (*pte & (PTE_P|PTE_COW)) == (PTE_P|PTE_COW))))
+			r = zero_page_fault(e->env_pgdir, (void *) va, write,
+					    ALLOC_NORECLAIM);
+		else if (!zero && (*pte & (PTE_P|PTE_COW)) == (PTE_P|PTE_COW))
+			r = page_cow_fault(e->env_pgdir, (void *) va,
+					   ALLOC_NORECLAIM, &tb);
+		else
+			continue;
+		if (r < 0)
+			break;
+		e->env_pgfaults_around += r;
+	}
+	tlb_batch_flush(&tb);
+}
+
 void
 page_fault_handler(struct Trapframe *tf)
 {
 	uint32_t fault_va;
+	int r;
 
 	// Read processor's CR2 register to find the faulting address
 	fault_va = rcr2();
 
 	// Handle kernel-mode page faults.
+	// Only the user memory accessors of kern/uaccess.c may fault.
 	if ((tf->tf_cs & 3) == 0)
 	{
-		struct PageInfo* ppi = page_alloc(ALLOC_ZERO);
-		if (!ppi)
-		{
-			cprintf("kernel page fault: %e\n", -E_NO_MEM);
-			panic("fall into kernel.");
-		}
-		page_insert(kern_pgdir, ppi, (void*)fault_va, PTE_W|PTE_P);
+		if (uaccess_fault(tf, fault_va))
+			return;
+		print_trapframe(tf);
+		panic("kernel page fault va %08x ip %08x", fault_va, tf->tf_eip);
 	}
 
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
+	curenv->env_pgfaults++;
+
+	// A write in a region whose page table is still shared since
+	// sys_fork gets a table of its own, and is then retried.
+	if ((tf->tf_err & FEC_WR)
+	    && pgdir_pt_shared(curenv->env_pgdir, (void *) fault_va)) {
+		if ((r = pgdir_unshare_pt(curenv->env_pgdir, (void *) fault_va)) < 0) {
+			cprintf("[%08x] unshare va %08x: %e\n", curenv->env_id, fault_va, r);
+			env_destroy(curenv);
+		}
+		return;
+	}
+
+	// A page that was swapped out is brought back before the
+	// environment ever sees the fault.
+	if ((r = swap_in(curenv->env_pgdir, (void *) fault_va)) > 0)
+		return;
+	if (r < 0) {
+		cprintf("[%08x] swap in va %08x: %e\n", curenv->env_id, fault_va, r);
+		env_destroy(curenv);
+		return;
+	}
+
+	// Demand-zero pages are mapped on first touch, and writes to
+	// the shared zero page get a private page.
+	if ((r = zero_page_fault(curenv->env_pgdir, (void *) fault_va,
+				 tf->tf_err & FEC_WR, 0)) != 0) {
+		if (r < 0) {
+			cprintf("[%08x] zero fill va %08x: %e\n", curenv->env_id, fault_va, r);
+			env_destroy(curenv);
+		} else
+			fault_around(curenv, fault_va, tf->tf_err & FEC_WR, 1);
+		return;
+	}
+
+	// Writes to pages merged by kern/ksm.c get a private copy.
+	if ((tf->tf_err & FEC_WR)
+	    && (r = ksm_unmerge(curenv->env_pgdir, (void *) fault_va)) != 0) {
+		if (r < 0) {
+			cprintf("[%08x] unmerge va %08x: %e\n", curenv->env_id, fault_va, r);
+			env_destroy(curenv);
+		}
+		return;
+	}
+
+	// So do writes to pages left copy-on-write by sys_fork, which
+	// is all the environment would do with them in its upcall.
+	if ((tf->tf_err & FEC_WR)
+	    && (r = page_cow_fault(curenv->env_pgdir, (void *) fault_va,
+				   0, NULL)) != 0) {
+		if (r < 0) {
+			cprintf("[%08x] copy-on-write va %08x: %e\n", curenv->env_id, fault_va, r);
+			env_destroy(curenv);
+		} else
+			fault_around(curenv, fault_va, 1, 0);
+		return;
+	}
 
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
@@ -450,7 +577,7 @@ page_fault_handler(struct Trapframe *tf)
 	// none.  The remaining three checks can be combined into a single test.
 	//
 	// Hints:
-	//   user_mem_assert() and env_run() are useful here.
+	//   copy_to_user() and env_run() are useful here.
 	//   To change what the user environment runs, modify 'curenv->env_tf'
 	//   (the 'tf' variable points at 'curenv->env_tf').
 
@@ -459,7 +586,7 @@ page_fault_handler(struct Trapframe *tf)
 	// ref to 北大报告
 	if (curenv->env_pgfault_upcall != NULL)
 	{
-		struct UTrapframe *utf;
+		struct UTrapframe *utf, kutf;
 		if (UXSTACKTOP-PGSIZE <= tf->tf_esp && tf->tf_esp < UXSTACKTOP)
 			utf = (struct UTrapframe *)
 				(tf->tf_esp - sizeof(struct UTrapframe) - 4);
@@ -468,12 +595,17 @@ page_fault_handler(struct Trapframe *tf)
 				(UXSTACKTOP - sizeof(struct UTrapframe));
 // 为什么要先减呢?注意,栈是自顶向下生长的,而我们的内存访问是自底向上的!
 // 因此指针当然要指向一片内存区域的【低端】起始地址!
-		user_mem_assert(curenv, (void *)utf, sizeof(struct UTrapframe), PTE_U|PTE_W);
-		utf->utf_eflags = tf->tf_eflags;
-		utf->utf_eip = tf->tf_eip;
-		utf->utf_err = tf->tf_err;utf->utf_esp = tf->tf_esp;
-		utf->utf_fault_va = fault_va;
-		utf->utf_regs = tf->tf_regs;
+		kutf.utf_eflags = tf->tf_eflags;
+		kutf.utf_eip = tf->tf_eip;
+		kutf.utf_err = tf->tf_err;kutf.utf_esp = tf->tf_esp;
+		kutf.utf_fault_va = fault_va;
+		kutf.utf_regs = tf->tf_regs;
+		if (copy_to_user(utf, &kutf, sizeof(kutf)) < 0) {
+			cprintf("[%08x] user_mem_check assertion failure for va %08x\n",
+				curenv->env_id, utf);
+			env_destroy(curenv);
+			return;
+		}
 		curenv->env_tf.tf_eip = (uint32_t) curenv->env_pgfault_upcall;
 		curenv->env_tf.tf_esp = (uint32_t) utf;
 		env_run(curenv); // This does not return
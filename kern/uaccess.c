@@ -0,0 +1,144 @@
+/* See COPYRIGHT for copyright information. */
+
+/*
+ * Access to user memory from the kernel.
+ *
+ * The accessors below touch user memory directly instead of walking
+ * the page tables to check it first.  Each instruction that may fault
+ * on a user address has an entry in the exception table, and a page
+ * fault on one of them goes to uaccess_fault: pages the kernel can
+ * bring in, as the user would have on touching them, are brought in
+ * and the access is retried; otherwise the accessor returns -E_FAULT.
+ */
+
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/uaccess.h>
+#include <kern/pmap.h>
+#include <kern/env.h>
+
+extern const struct ExtableEntry __EXTABLE_BEGIN__[], __EXTABLE_END__[];
+
+static void check_uaccess(void);
+
+void
+uaccess_init(void)
+{
+	check_uaccess();
+}
+
+// Where to go on if the instruction at eip faults, or 0 if it may not.
+static uintptr_t
+extable_fixup(uintptr_t eip)
+{
+	const struct ExtableEntry *ex;
+
+	for (ex = __EXTABLE_BEGIN__; ex < __EXTABLE_END__; ex++)
+		if (ex->ex_insn == eip)
+			return ex->ex_fixup;
+	return 0;
+}
+
+//
+// Handle a page fault at fault_va taken by the kernel, with tf its trap
+// frame.  Returns false if the faulting instruction is not allowed to
+// fault, which is a kernel bug.  Otherwise the instruction is either
+// retried, if the page is now mapped as it needs, or skipped to its
+// fixup code.
+//
+bool
+uaccess_fault(struct Trapframe *tf, uintptr_t fault_va)
+{
+	uintptr_t fixup;
+	bool write = tf->tf_err & FEC_WR;
+	int perm = PTE_P | PTE_U | (write ? PTE_W : 0);
+	pte_t *pte;
+
+	if (!(fixup = extable_fixup(tf->tf_eip)))
+		return false;
+	if (curenv && fault_va < ULIM
+	    && user_page_prepare(curenv->env_pgdir, (void *) fault_va, write) >= 0
+	    && (pte = pgdir_walk(curenv->env_pgdir, (void *) fault_va, 0))
+	    && (*pte & perm) == perm
+	    && !(write && pgdir_pt_shared(curenv->env_pgdir, (void *) fault_va)))
+		return true;
+	tf->tf_eip = fixup;
+	return true;
+}
+
+// Whether [va, va+n) lies below ULIM.
+static bool
+user_range_ok(const void *va, size_t n)
+{
+	return (uintptr_t) va <= ULIM && n <= ULIM - (uintptr_t) va;
+}
+
+// Copy n bytes from src to dst, either of which may be a user address.
+// Returns the number of bytes a fault left uncopied.
+static size_t
+uaccess_copy(void *dst, const void *src, size_t n)
+{
+	// A fault in rep movsb leaves %ecx counting the bytes left.
+	asm volatile("1:	rep movsb\n"
+		     "2:\n"
+		     EXTABLE_ENTRY(1b, 2b)
+		     : "+D" (dst), "+S" (src), "+c" (n)
+		     : : "memory");
+	return n;
+}
+
+//
+// Copy n bytes from user address usrc in the current address space to
+// dst.  Returns 0 on success, or -E_FAULT if some of [usrc, usrc+n) is
+// not readable by the user, in which case dst may be partly written.
+//
+int
+copy_from_user(void *dst, const void *usrc, size_t n)
+{
+	if (!user_range_ok(usrc, n) || uaccess_copy(dst, usrc, n))
+		return -E_FAULT;
+	return 0;
+}
+
+//
+// Copy n bytes from src to user address udst in the current address
+// space.  Returns 0 on success, or -E_FAULT if some of [udst, udst+n) is
+// not writable by the user, in which case udst may be partly written.
+//
+int
+copy_to_user(void *udst, const void *src, size_t n)
+{
+	if (!user_range_ok(udst, n) || uaccess_copy(udst, src, n))
+		return -E_FAULT;
+	return 0;
+}
+
+// Nothing is mapped below UTOP in kern_pgdir and the pages above are
+// read-only, so the fixups can be tried before any environment runs.
+static void
+check_uaccess(void)
+{
+	char buf[16];
+	void *va = (void *) UTEXT;
+
+	assert(__EXTABLE_END__ - __EXTABLE_BEGIN__ > 0);
+
+	// unmapped pages
+	assert(copy_from_user(buf, va, sizeof(buf)) == -E_FAULT);
+	assert(copy_to_user(va, buf, sizeof(buf)) == -E_FAULT);
+
+	// read-only pages, and a copy running into them
+	assert(copy_from_user(buf, (void *) UPAGES, sizeof(buf)) == 0);
+	assert(memcmp(buf, pages, sizeof(buf)) == 0);
+	assert(copy_to_user((void *) UPAGES, buf, sizeof(buf)) == -E_FAULT);
+	assert(copy_from_user(buf, (void *) (UENVS - 8), sizeof(buf)) == -E_FAULT);
+
+	// kernel memory is refused without being touched
+	assert(copy_from_user(buf, (void *) KERNBASE, 1) == -E_FAULT);
+	assert(copy_from_user(buf, (void *) (ULIM - 8), sizeof(buf)) == -E_FAULT);
+	assert(copy_to_user((void *) ~0, buf, 2) == -E_FAULT);
+
+	cprintf("check_uaccess() succeeded!\n");
+}
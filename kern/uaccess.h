@@ -0,0 +1,33 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_UACCESS_H
+#define JOS_KERN_UACCESS_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/trap.h>
+
+// An instruction that may fault on a user address, and where to go on
+// if the fault cannot be resolved.  The linker gathers them all between
+// __EXTABLE_BEGIN__ and __EXTABLE_END__.
+struct ExtableEntry {
+	uintptr_t ex_insn;
+	uintptr_t ex_fixup;
+};
+
+// Record, in inline assembly, that the instruction at label insn
+// continues at label fixup if it faults.
+#define EXTABLE_ENTRY(insn, fixup)			\
+	".pushsection __ex_table, \"a\"\n"		\
+	"	.long " #insn ", " #fixup "\n"		\
+	".popsection\n"
+
+void	uaccess_init(void);
+bool	uaccess_fault(struct Trapframe *tf, uintptr_t fault_va);
+
+int	copy_from_user(void *dst, const void *usrc, size_t n);
+int	copy_to_user(void *udst, const void *src, size_t n);
+
+#endif // !JOS_KERN_UACCESS_H
@@ -0,0 +1,193 @@
+/* See COPYRIGHT for copyright information. */
+
+/*
+ * The shared zero page.
+ *
+ * zero_page_reserve leaves a demand-zero PTE where sys_page_alloc
+ * would allocate and clear a page.  A read fault on it maps the one
+ * global zero page instead, read-only and with PTE_COW if the page is
+ * meant to be writable.  Only a write fault allocates a private page,
+ * and no copy is needed to fill it.
+ */
+
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/zeropage.h>
+#include <kern/pmap.h>
+#include <kern/swap.h>
+#include <kern/ksm.h>
+
+// pp_ref is 16 bits: past this many mappings, the zero page is not
+// mapped again, and a private page is used instead.
+#define ZERO_PAGE_MAXREF	0xf000
+
+static struct PageInfo *zero_page;
+
+static void check_zero_page(void);
+
+void
+zero_page_init(void)
+{
+	if (!(zero_page = page_alloc(ALLOC_ZERO | ALLOC_HIGHMEM)))
+		panic("zero_page_init: out of memory");
+	// Our own reference keeps it from ever being freed.
+	zero_page->pp_ref++;
+	check_zero_page();
+}
+
+//
+// Make va in pgdir a demand-zero page with permissions perm, which
+// must include PTE_U.  Whatever was mapped at va is unmapped.
+// Returns 0 on success, or -E_NO_MEM if a page table was needed and
+// could not be allocated.
+//
+int
+zero_page_reserve(pde_t *pgdir, void *va, int perm)
+{
+	pte_t *pte;
+
+	assert(perm & PTE_U);
+	if (!(pte = pgdir_walk(pgdir, va, 1)))
+		return -E_NO_MEM;
+	// Count the new PTE first, as page_insert does.
+	pte2pgtable(pte)->pp_ptcount++;
+	if (*pte)
+		page_remove(pgdir, va);
+	*pte = perm & PTE_SYSCALL & ~PTE_P;
+	return 0;
+}
+
+//
+// Resolve an access to va in pgdir if it is a demand-zero page, or a
+// write to the zero page mapped copy-on-write.
+// alloc_flags are added to those of the private page's
+// page_alloc_reclaim.
+// Returns 1 if it did, 0 if va is neither, and -E_NO_MEM if there was
+// no memory for a page or page table.
+//
+int
+zero_page_fault(pde_t *pgdir, void *va, bool write, int alloc_flags)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	int perm, r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if (!(pte = pgdir_walk(pgdir, va, 0)))
+		return 0;
+	if (PTE_DEMAND_ZERO(*pte))
+		perm = (*pte & PTE_SYSCALL) | PTE_P;
+	else if (write && (*pte & (PTE_P|PTE_COW)) == (PTE_P|PTE_COW)
+		 && PTE_ADDR(*pte) == page2pa(zero_page))
+		perm = ((*pte & PTE_SYSCALL) & ~PTE_COW) | PTE_W;
+	else
+		return 0;
+
+	// A write to a read-only page is left to fault again on the
+	// zero page, and reach the environment.
+	if ((!write || !(perm & PTE_W)) && zero_page->pp_ref < ZERO_PAGE_MAXREF) {
+		if (perm & PTE_W)
+			perm = (perm & ~PTE_W) | PTE_COW;
+		pp = zero_page;
+	} else if (!(pp = page_alloc_reclaim(ALLOC_ZERO | ALLOC_HIGHMEM
+						 | alloc_color(pgdir, va)
+						 | alloc_flags)))
+		return -E_NO_MEM;
+
+	if ((r = page_insert(pgdir, pp, va, perm)) < 0) {
+		if (pp != zero_page)
+			page_free(pp);
+		return r;
+	}
+	return 1;
+}
+
+//
+// Return the page to map for pp: pp itself, unless it is the zero page
+// and has all the mappings it can take, in which case a new zeroed
+// page from page_alloc(ALLOC_ZERO | alloc_flags).
+// Returns NULL if there was no memory for the new page.
+//
+struct PageInfo *
+zero_page_share(struct PageInfo *pp, int alloc_flags)
+{
+	if (pp != zero_page || pp->pp_ref < ZERO_PAGE_MAXREF)
+		return pp;
+	return page_alloc(ALLOC_ZERO | alloc_flags);
+}
+
+// Take a demand-zero page through a read and a write fault in a
+// scratch address space.
+static void
+check_zero_page(void)
+{
+	struct PageInfo *pp;
+	pde_t *pgdir;
+	pte_t *pte;
+	uint32_t *p;
+	void *va = (void *) UTEXT;
+	int i, ref = zero_page->pp_ref;
+
+	assert((pgdir = pgdir_alloc()));
+	assert(zero_page_reserve(pgdir, va, PTE_P|PTE_U|PTE_W) == 0);
+	pte = pgdir_walk(pgdir, va, 0);
+	assert(PTE_DEMAND_ZERO(*pte) && (*pte & PTE_W));
+	assert(page_lookup(pgdir, va, NULL) == NULL);
+	assert(pgdir_nmapped(pgdir) == 0);
+
+	// a read maps the zero page copy-on-write
+	assert(zero_page_fault(pgdir, va, 0, 0) == 1);
+	assert(page_lookup(pgdir, va, NULL) == zero_page);
+	assert((*pte & (PTE_W|PTE_COW)) == PTE_COW);
+	assert(zero_page->pp_ref == ref + 1);
+	assert(zero_page_fault(pgdir, va, 0, 0) == 0);
+
+	// a write gets a private page
+	assert(zero_page_fault(pgdir, va, 1, 0) == 1);
+	pp = page_lookup(pgdir, va, NULL);
+	assert(pp && pp != zero_page && pp->pp_ref == 1);
+	assert((*pte & (PTE_W|PTE_COW)) == PTE_W);
+	assert(zero_page->pp_ref == ref);
+	p = kmap(pp);
+	for (i = 0; i < PGSIZE / 4; i++)
+		assert(p[i] == 0);
+	kunmap(p);
+	assert(zero_page_fault(pgdir, va, 1, 0) == 0);
+
+	// a first write skips the zero page, a read-only page doesn't
+	assert(zero_page_reserve(pgdir, va, PTE_P|PTE_U|PTE_W) == 0);
+	assert(zero_page_fault(pgdir, va, 1, 0) == 1);
+	assert(page_lookup(pgdir, va, NULL) != zero_page);
+	assert(zero_page_reserve(pgdir, va, PTE_P|PTE_U) == 0);
+	assert(zero_page_fault(pgdir, va, 1, 0) == 1);
+	assert(page_lookup(pgdir, va, NULL) == zero_page);
+	assert(!(*pte & (PTE_W|PTE_COW)));
+	assert(zero_page_fault(pgdir, va, 1, 0) == 0);
+
+	// past ZERO_PAGE_MAXREF, mapping the zero page maps a zeroed
+	// private page instead, here in place of the zero page itself
+	assert(page_lookup(pgdir, va, NULL) == zero_page);
+	zero_page->pp_ref = ZERO_PAGE_MAXREF;
+	assert(page_insert(pgdir, zero_page, va, PTE_U|PTE_COW) == 0);
+	pp = page_lookup(pgdir, va, NULL);
+	assert(pp && pp != zero_page && pp->pp_ref == 1);
+	assert(zero_page->pp_ref == ZERO_PAGE_MAXREF - 1);
+	p = kmap(pp);
+	for (i = 0; i < PGSIZE / 4; i++)
+		assert(p[i] == 0);
+	kunmap(p);
+	zero_page->pp_ref = ref;
+
+	// unmapping a demand-zero page just clears the PTE, and with it
+	// the page table
+	assert(zero_page_reserve(pgdir, va, PTE_P|PTE_U|PTE_W) == 0);
+	assert(zero_page->pp_ref == ref);
+	assert(pte2pgtable(pte)->pp_ptcount == 1);
+	page_remove(pgdir, va);
+	assert(!(pgdir[PDX(va)] & PTE_P));
+
+	pgdir_free(pgdir);
+	cprintf("check_zero_page() succeeded!\n");
+}
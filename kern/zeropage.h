@@ -0,0 +1,20 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_ZEROPAGE_H
+#define JOS_KERN_ZEROPAGE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/memlayout.h>
+
+// The PTE of a demand-zero page that was never touched has PTE_P clear
+// and no address, but keeps the other permission bits (at least PTE_U).
+#define PTE_DEMAND_ZERO(pte)	(!((pte) & PTE_P) && !PTE_ADDR(pte) && (pte))
+
+void	zero_page_init(void);
+int	zero_page_reserve(pde_t *pgdir, void *va, int perm);
+int	zero_page_fault(pde_t *pgdir, void *va, bool write, int alloc_flags);
+struct PageInfo *zero_page_share(struct PageInfo *pp, int alloc_flags);
+
+#endif // !JOS_KERN_ZEROPAGE_H
@@ -0,0 +1,105 @@
+/* See COPYRIGHT for copyright information. */
+
+/*
+ * The compressed swap tier.  swap_out first tries to compress its
+ * victim with kern/lz.c into a kmalloc'd buffer; only pages that don't
+ * compress to ZRAM_MAX_SIZE, or that find the tier full, go to disk.
+ * Each stored page is named by a handle, which the swapped-out PTE
+ * holds instead of a disk slot (see kern/swap.h).
+ */
+
+#include <inc/string.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/zram.h>
+#include <kern/lz.h>
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
+
+struct ZramEntry {
+	void *ze_data;			// Compressed page, NULL if unused
+	uint32_t ze_size;		// Length of ze_data
+};
+
+static struct ZramEntry *zram_table;
+static uint32_t zram_hint;		// Where to look for a free handle
+
+void
+zram_init(void)
+{
+	zram_table = kmalloc(ZRAM_NENTRIES * sizeof(struct ZramEntry));
+	if (!zram_table)
+		panic("zram_init: out of memory");
+	memset(zram_table, 0, ZRAM_NENTRIES * sizeof(struct ZramEntry));
+}
+
+//
+// Compress page pp into the tier.
+// Returns its handle, or -E_NO_MEM if it doesn't compress well enough
+// or there is no room for it.
+//
+int
+zram_store(struct PageInfo *pp)
+{
+	// Callers are serialized by the big kernel lock.
+	static uint8_t buf[ZRAM_MAX_SIZE];
+	uint32_t i, h;
+	size_t n;
+	void *src;
+
+	for (i = 0; i < ZRAM_NENTRIES; i++) {
+		h = (zram_hint + i) % ZRAM_NENTRIES;
+		if (!zram_table[h].ze_data)
+			break;
+	}
+	if (i == ZRAM_NENTRIES)
+		return -E_NO_MEM;
+
+	src = kmap(pp);
+	n = lz_compress(src, buf, PGSIZE, ZRAM_MAX_SIZE);
+	kunmap(src);
+	if (n > ZRAM_MAX_SIZE) {
+		meminfo_add(&meminfo.mi_zram_rejected, 1, NULL);
+		return -E_NO_MEM;
+	}
+	if (!(zram_table[h].ze_data = kmalloc(n)))
+		return -E_NO_MEM;
+
+	memmove(zram_table[h].ze_data, buf, n);
+	zram_table[h].ze_size = n;
+	zram_hint = h + 1;
+	meminfo_add(&meminfo.mi_zram_stored, 1, NULL);
+	meminfo_add(&meminfo.mi_zram_bytes, n, NULL);
+	return h;
+}
+
+//
+// Decompress the page with this handle into pp.  The handle stays
+// valid until zram_free.
+//
+int
+zram_load(uint32_t handle, struct PageInfo *pp)
+{
+	struct ZramEntry *ze = &zram_table[handle];
+	void *dst;
+	int r;
+
+	assert(handle < ZRAM_NENTRIES && ze->ze_data);
+	dst = kmap(pp);
+	r = lz_decompress(ze->ze_data, dst, ze->ze_size, PGSIZE);
+	kunmap(dst);
+	return r < 0 ? -E_IO : 0;
+}
+
+void
+zram_free(uint32_t handle)
+{
+	struct ZramEntry *ze = &zram_table[handle];
+
+	assert(handle < ZRAM_NENTRIES && ze->ze_data);
+	kfree(ze->ze_data);
+	ze->ze_data = NULL;
+	meminfo_add(&meminfo.mi_zram_stored, -1, NULL);
+	meminfo_add(&meminfo.mi_zram_bytes, -ze->ze_size, NULL);
+}
@@ -0,0 +1,19 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_ZRAM_H
+#define JOS_KERN_ZRAM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/memlayout.h>
+
+#define ZRAM_NENTRIES	8192		// Pages the compressed tier holds
+#define ZRAM_MAX_SIZE	(PGSIZE / 2)	// Pages that compress worse go to disk
+
+void	zram_init(void);
+int	zram_store(struct PageInfo *pp);
+int	zram_load(uint32_t handle, struct PageInfo *pp);
+void	zram_free(uint32_t handle);
+
+#endif // !JOS_KERN_ZRAM_H
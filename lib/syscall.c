@@ -111,3 +111,52 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_meminfo(envid_t envid, struct MemInfo *info)
+{
+	return syscall(SYS_meminfo, 0, envid, (uint32_t)info, 0, 0, 0);
+}
+
+int
+sys_page_reserve(envid_t envid, void *va, int perm)
+{
+	return syscall(SYS_page_reserve, 1, envid, (uint32_t) va, perm, 0, 0);
+}
+
+int
+sys_page_alloc_range(envid_t envid, void *va, size_t npages, int perm)
+{
+	return syscall(SYS_page_alloc_range, 0, envid, (uint32_t) va, npages, perm, 0);
+}
+
+int
+sys_page_map_range(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva,
+		   size_t npages, int perm)
+{
+	// Five arguments is all a system call takes: npages and perm
+	// share the last one.  Like sys_page_alloc_range, this returns a
+	// page count, so a positive result is no error.
+	if (npages > (~(uint32_t) 0 >> PGSHIFT) || perm != PGOFF(perm))
+		return -E_INVAL;
+	return syscall(SYS_page_map_range, 0, srcenv, (uint32_t) srcva,
+		       dstenv, (uint32_t) dstva, (npages << PGSHIFT) | perm);
+}
+
+int
+sys_page_unmap_range(envid_t envid, void *va, size_t npages)
+{
+	return syscall(SYS_page_unmap_range, 1, envid, (uint32_t) va, npages, 0, 0);
+}
+
+int
+sys_env_set_fault_around(envid_t envid, size_t npages)
+{
+	return syscall(SYS_env_set_fault_around, 1, envid, npages, 0, 0, 0);
+}
+
+envid_t
+sys_fork(void)
+{
+	// The child's envid is positive, so don't check the result.
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
@@ -0,0 +1,51 @@
+// test copy-on-write faults resolved in the kernel: fork with no page
+// fault handler, and check that parent and child each see their own
+// writes, copied while shared and taken back once the child is gone
+
+#include <inc/lib.h>
+
+#define NPAGES	8
+
+static char buf[NPAGES * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+void
+umain(int argc, char **argv)
+{
+	struct MemInfo before, mi;
+	envid_t child;
+	int i, r;
+
+	// Different contents keep the pages from being merged.
+	for (i = 0; i < NPAGES; i++)
+		buf[i * PGSIZE] = i + 1;
+	if ((r = sys_meminfo(0, &before)) < 0)
+		panic("sys_meminfo: %e", r);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		for (i = 0; i < NPAGES; i++)
+			buf[i * PGSIZE] = NPAGES + i;
+		for (i = 0; i < NPAGES; i++)
+			if (buf[i * PGSIZE] != NPAGES + i)
+				panic("child lost its write to page %d", i);
+		return;
+	}
+
+	while (envs[ENVX(child)].env_id == child
+	       && envs[ENVX(child)].env_status != ENV_FREE)
+		sys_yield();
+	for (i = 0; i < NPAGES; i++)
+		if (buf[i * PGSIZE] != i + 1)
+			panic("child's write to page %d seen by parent", i);
+	for (i = 0; i < NPAGES; i++)
+		buf[i * PGSIZE] = 2 * NPAGES + i;
+
+	if ((r = sys_meminfo(0, &mi)) < 0)
+		panic("sys_meminfo: %e", r);
+	if (mi.mi_cow_copied < before.mi_cow_copied + NPAGES)
+		panic("only %d pages copied", mi.mi_cow_copied - before.mi_cow_copied);
+	if (mi.mi_cow_reused < before.mi_cow_reused + NPAGES)
+		panic("only %d pages reused", mi.mi_cow_reused - before.mi_cow_reused);
+	cprintf("cow ok\n");
+}
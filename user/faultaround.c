@@ -0,0 +1,71 @@
+// test fault-around: touching a demand-zero region, and then writing to
+// it in a forked child, takes one page fault per fault-around window
+// instead of one per page
+
+#include <inc/lib.h>
+
+#define NPAGES	64
+#define AROUND	16
+
+static void
+check_faults(struct MemInfo *before, const char *what)
+{
+	struct MemInfo mi;
+	int r;
+
+	if ((r = sys_meminfo(0, &mi)) < 0)
+		panic("sys_meminfo: %e", r);
+	// One more fault may come first, to give us our own page table.
+	if (mi.mi_env_faults - before->mi_env_faults > NPAGES / AROUND + 1)
+		panic("%s: %d faults", what, mi.mi_env_faults - before->mi_env_faults);
+	if (mi.mi_env_faults_around - before->mi_env_faults_around
+	    < NPAGES - NPAGES / AROUND)
+		panic("%s: only %d pages resolved around faults", what,
+		      mi.mi_env_faults_around - before->mi_env_faults_around);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct MemInfo before;
+	char *va = (char *) UTEMP;
+	envid_t child;
+	int i, r;
+
+	if ((r = sys_env_set_fault_around(0, FAULT_AROUND_MAX + 1)) != -E_INVAL)
+		panic("sys_env_set_fault_around: %e", r);
+	if ((r = sys_env_set_fault_around(0, AROUND)) < 0)
+		panic("sys_env_set_fault_around: %e", r);
+	for (i = 0; i < NPAGES; i++)
+		if ((r = sys_page_reserve(0, va + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_reserve: %e", r);
+
+	if ((r = sys_meminfo(0, &before)) < 0)
+		panic("sys_meminfo: %e", r);
+	// Different contents keep the pages from being merged.
+	for (i = 0; i < NPAGES; i++)
+		va[i * PGSIZE] = i + 1;
+	check_faults(&before, "demand-zero");
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		// The setting came along with fork.
+		if ((r = sys_meminfo(0, &before)) < 0)
+			panic("sys_meminfo: %e", r);
+		for (i = 0; i < NPAGES; i++)
+			va[i * PGSIZE] = NPAGES + i;
+		check_faults(&before, "copy-on-write");
+		for (i = 0; i < NPAGES; i++)
+			if (va[i * PGSIZE] != NPAGES + i)
+				panic("page %d lost its write", i);
+		cprintf("faultaround ok\n");
+		return;
+	}
+	while (envs[ENVX(child)].env_id == child
+	       && envs[ENVX(child)].env_status != ENV_FREE)
+		sys_yield();
+	for (i = 0; i < NPAGES; i++)
+		if (va[i * PGSIZE] != i + 1)
+			panic("child's write to page %d seen by parent", i);
+}
@@ -0,0 +1,45 @@
+// test same-page merging: identical pages get merged in the background,
+// and writing to one gives it a private copy again
+
+#include <inc/lib.h>
+
+#define NPAGES	8
+
+void
+umain(int argc, char **argv)
+{
+	struct MemInfo before, mi;
+	char *va = (char *) UTEMP;
+	int i, r;
+
+	if ((r = sys_meminfo(0, &before)) < 0)
+		panic("sys_meminfo: %e", r);
+	for (i = 0; i < NPAGES; i++) {
+		if ((r = sys_page_alloc(0, va + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		memset(va + i * PGSIZE, 0x6b, PGSIZE);
+	}
+
+	// Give the scanner some clock ticks.
+	for (i = 0; i < 100000; i++) {
+		if ((r = sys_meminfo(0, &mi)) < 0)
+			panic("sys_meminfo: %e", r);
+		if (mi.mi_ksm_merged >= before.mi_ksm_merged + NPAGES - 1)
+			break;
+		sys_yield();
+	}
+	if (i == 100000)
+		panic("only %d pages merged", mi.mi_ksm_merged - before.mi_ksm_merged);
+
+	for (i = 0; i < NPAGES; i++)
+		va[i * PGSIZE] = i;
+	for (i = 0; i < NPAGES; i++)
+		if (va[i * PGSIZE] != i || va[i * PGSIZE + PGSIZE - 1] != 0x6b)
+			panic("page %d corrupted after unmerge", i);
+	if ((r = sys_meminfo(0, &mi)) < 0)
+		panic("sys_meminfo: %e", r);
+	if (mi.mi_ksm_unmerged < before.mi_ksm_unmerged + NPAGES)
+		panic("only %d pages unmerged",
+		      mi.mi_ksm_unmerged - before.mi_ksm_unmerged);
+	cprintf("ksm ok\n");
+}
@@ -0,0 +1,74 @@
+// test sys_meminfo: the counters must follow our own page allocations
+
+#include <inc/lib.h>
+
+#define NPAGES	8
+
+static volatile pte_t *stale_pte;
+
+// Reading the PTE of a reclaimed page table must fault.
+static void
+uvpt_fault(struct UTrapframe *utf)
+{
+	if (ROUNDDOWN(utf->utf_fault_va, PGSIZE) != ROUNDDOWN((uintptr_t) stale_pte, PGSIZE))
+		panic("unexpected fault at va %08x", utf->utf_fault_va);
+	cprintf("meminfo ok\n");
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct MemInfo before, after;
+	char *va = (char *) UTEMP;
+	int i, r;
+
+	if ((r = sys_meminfo(0, &before)) < 0)
+		panic("sys_meminfo: %e", r);
+	for (i = 0; i < NPAGES; i++)
+		if ((r = sys_page_alloc(0, va + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+	if ((r = sys_meminfo(0, &after)) < 0)
+		panic("sys_meminfo: %e", r);
+
+	if (after.mi_env_resident != before.mi_env_resident + NPAGES)
+		panic("resident %d, expected %d", after.mi_env_resident,
+		      before.mi_env_resident + NPAGES);
+	if (after.mi_free > before.mi_free - NPAGES)
+		panic("free %d after allocating %d of %d", after.mi_free,
+		      NPAGES, before.mi_free);
+	if (after.mi_free > after.mi_total || after.mi_free_min > after.mi_free)
+		panic("inconsistent free counts");
+
+	// the kernel copies straight to our memory: a demand-zero page is
+	// filled in on the way, bad buffers are refused
+	if ((r = sys_page_reserve(0, va + NPAGES * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_reserve: %e", r);
+	if ((r = sys_meminfo(0, (struct MemInfo *) (va + NPAGES * PGSIZE))) < 0)
+		panic("sys_meminfo to a demand-zero page: %e", r);
+	if ((r = sys_meminfo(0, (struct MemInfo *) (va - sizeof(after) / 2))) != -E_FAULT)
+		panic("sys_meminfo to an unmapped page: %e", r);
+	if ((r = sys_meminfo(0, (struct MemInfo *) ULIM)) != -E_FAULT)
+		panic("sys_meminfo to the kernel: %e", r);
+	sys_page_unmap(0, va + NPAGES * PGSIZE);
+
+	// have the page table's alias in the UVPT self-mapping cached
+	stale_pte = &uvpt[PGNUM(va)];
+	if (!(*stale_pte & PTE_P))
+		panic("uvpt does not show our page");
+
+	for (i = 0; i < NPAGES; i++)
+		sys_page_unmap(0, va + i * PGSIZE);
+	if ((r = sys_meminfo(0, &after)) < 0)
+		panic("sys_meminfo: %e", r);
+	if (after.mi_env_resident != before.mi_env_resident)
+		panic("resident %d after unmap, expected %d",
+		      after.mi_env_resident, before.mi_env_resident);
+	// nothing else is mapped around UTEMP, so its page table goes too
+	if (after.mi_pgtables_reclaimed == before.mi_pgtables_reclaimed)
+		panic("empty page table not reclaimed");
+	if (uvpd[PDX(va)] & PTE_P)
+		panic("reclaimed page table still in the page directory");
+	set_pgfault_handler(uvpt_fault);
+	panic("read %08x through uvpt from a reclaimed page table", *stale_pte);
+}
@@ -0,0 +1,38 @@
+// synthetic memory pressure: touch more pages than the machine has
+// (run with QEMUEXTRA="-m 32"), then check that they all come back
+// from swap intact
+
+#include <inc/lib.h>
+
+#define NPAGES	12288
+#define BASE	((char *) 0x10000000)
+
+void
+umain(int argc, char **argv)
+{
+	struct MemInfo mi;
+	char *va;
+	int i, r;
+
+	for (i = 0; i < NPAGES; i++) {
+		va = BASE + i * PGSIZE;
+		if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc %d: %e", i, r);
+		memset(va, 0x6b, PGSIZE);
+		*(int *) va = i;
+	}
+	for (i = 0; i < NPAGES; i++) {
+		va = BASE + i * PGSIZE;
+		if (*(int *) va != i || va[PGSIZE - 1] != 0x6b)
+			panic("page %d corrupted", i);
+	}
+
+	if ((r = sys_meminfo(0, &mi)) < 0)
+		panic("sys_meminfo: %e", r);
+	cprintf("%u pages out, %u in, %u compressed in %uK\n",
+		mi.mi_swap_outs, mi.mi_swap_ins, mi.mi_zram_stored,
+		mi.mi_zram_bytes / 1024);
+	if (mi.mi_swap_outs == 0)
+		panic("nothing was swapped out");
+	cprintf("mempress ok\n");
+}
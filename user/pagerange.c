@@ -0,0 +1,59 @@
+// test the range page syscalls: allocate, map and unmap many pages at
+// once, and stop at the first page that can't be mapped
+
+#include <inc/lib.h>
+
+#define NPAGES	1024
+#define BASE	((char *) 0x10000000)
+#define BASE2	((char *) 0x20000000)
+
+void
+umain(int argc, char **argv)
+{
+	struct MemInfo before, mi;
+	int i, r;
+
+	if ((r = sys_meminfo(0, &before)) < 0)
+		panic("sys_meminfo: %e", r);
+	if ((r = sys_page_alloc_range(0, BASE, NPAGES, PTE_P|PTE_U|PTE_W)) != NPAGES)
+		panic("sys_page_alloc_range: %d", r);
+	for (i = 0; i < NPAGES; i++) {
+		if (BASE[i * PGSIZE] != 0)
+			panic("page %d not zero", i);
+		BASE[i * PGSIZE] = i;
+	}
+
+	// a read-only alias of all of it
+	if ((r = sys_page_map_range(0, BASE, 0, BASE2, NPAGES, PTE_P|PTE_U)) != NPAGES)
+		panic("sys_page_map_range: %d", r);
+	for (i = 0; i < NPAGES; i++)
+		if (BASE2[i * PGSIZE] != (char) i || (uvpt[PGNUM(BASE2 + i * PGSIZE)] & PTE_W))
+			panic("alias of page %d wrong", i);
+
+	// the destination must be page-aligned
+	if ((r = sys_page_map_range(0, BASE, 0, BASE2 + PTE_W, 1, PTE_P|PTE_U)) != -E_INVAL)
+		panic("sys_page_map_range to a misaligned va: %d", r);
+
+	// mapping stops at a hole, and says where
+	if ((r = sys_page_unmap_range(0, BASE + 100 * PGSIZE, 1)) < 0)
+		panic("sys_page_unmap_range: %e", r);
+	if ((r = sys_page_map_range(0, BASE, 0, BASE2, NPAGES, PTE_P|PTE_U|PTE_W)) != 100)
+		panic("sys_page_map_range over a hole: %d", r);
+	if (!(uvpt[PGNUM(BASE2 + 99 * PGSIZE)] & PTE_W)
+	    || (uvpt[PGNUM(BASE2 + 100 * PGSIZE)] & PTE_W))
+		panic("sys_page_map_range over a hole mapped the wrong pages");
+
+	// unmapping skips the page tables that aren't there
+	if ((r = sys_page_unmap_range(0, BASE, (BASE2 - BASE) / PGSIZE + NPAGES)) < 0)
+		panic("sys_page_unmap_range: %e", r);
+	for (i = 0; i < NPAGES; i++)
+		if ((uvpd[PDX(BASE + i * PGSIZE)] & PTE_P)
+		    && (uvpt[PGNUM(BASE + i * PGSIZE)] & PTE_P))
+			panic("page %d still mapped", i);
+	if ((r = sys_meminfo(0, &mi)) < 0)
+		panic("sys_meminfo: %e", r);
+	// The page tables stay.
+	if (before.mi_free - mi.mi_free > 16)
+		panic("%d pages not freed", before.mi_free - mi.mi_free);
+	cprintf("pagerange ok\n");
+}
@@ -0,0 +1,41 @@
+// test demand-zero pages: reading reserved pages takes no memory,
+// and writing to one gives it a page of its own
+
+#include <inc/lib.h>
+
+#define NPAGES	1024
+#define BASE	((char *) 0x10000000)
+
+void
+umain(int argc, char **argv)
+{
+	struct MemInfo before, mi;
+	char *va;
+	int i, r;
+
+	for (i = 0; i < NPAGES; i++)
+		if ((r = sys_page_reserve(0, BASE + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_reserve %d: %e", i, r);
+	if ((r = sys_meminfo(0, &before)) < 0)
+		panic("sys_meminfo: %e", r);
+
+	for (i = 0; i < NPAGES; i++) {
+		va = BASE + i * PGSIZE;
+		if (va[0] != 0 || va[PGSIZE - 1] != 0)
+			panic("page %d not zero", i);
+	}
+	if ((r = sys_meminfo(0, &mi)) < 0)
+		panic("sys_meminfo: %e", r);
+	// A few pages for reverse map nodes are fine, one per page isn't.
+	if (before.mi_free - mi.mi_free > NPAGES / 16)
+		panic("reading took %d pages", before.mi_free - mi.mi_free);
+
+	for (i = 0; i < NPAGES; i += 2)
+		BASE[i * PGSIZE] = i;
+	for (i = 0; i < NPAGES; i++) {
+		va = BASE + i * PGSIZE;
+		if (va[0] != (i % 2 ? 0 : (char) i) || va[PGSIZE - 1] != 0)
+			panic("page %d corrupted after write", i);
+	}
+	cprintf("zeropage ok\n");
+}